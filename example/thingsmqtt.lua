@@ -31,6 +31,9 @@ print("Connected!")
 
 lme_thing:send()
 
-while true do
-	lme_thing:loop()
-end
+-- Send the telemetry every 10 seconds, sleeping in between
+lme_thing:every(10000, function()
+	lme_thing:send()
+end)
+
+lme_thing:run()
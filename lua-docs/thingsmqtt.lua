@@ -1,7 +1,8 @@
 --- @meta
 
 --- @alias ThingsMqttSslConfig { ca_file: string, cert_file: string, key_file: string, verify_peer?: boolean, verify_hostname?: boolean }
---- @alias ThingsMqttConfig { host: string, port: integer?, bind_address: string?, keepalive: integer?, client_id: string?, username: string?, password: string?, ssl_config?: ThingsMqttSslConfig }
+--- @alias ThingsMqttQos 0|1|2
+--- @alias ThingsMqttConfig { host: string, port: integer?, bind_address: string?, keepalive: integer?, client_id: string?, username: string?, password: string?, ssl_config?: ThingsMqttSslConfig, batch_telemetry: boolean?, max_payload_size: integer?, flush_interval: integer?, max_pending_age: integer?, max_pending_count: integer?, offline_max_entries: integer?, offline_max_bytes: integer?, offline_overflow: "drop_oldest"|"drop_newest"|"decimate"|nil, replay_window: integer?, replay_rate: number?, replay_batch_size: integer?, telemetry_qos: ThingsMqttQos?, attributes_qos: ThingsMqttQos?, attribute_state_file: string?, spool_dir: string?, spool_segment_size: integer?, spool_max_segments: integer? }
 
 --- @class ThingsMqtt
 local ThingsMqtt = {}
@@ -9,6 +10,11 @@ local ThingsMqtt = {}
 --- @return ThingsMqtt
 function ThingsMqtt.new() end
 
+--- Creates a reactor driving many clients from one thread.
+--- Only available on Linux, as it uses epoll.
+--- @return ThingsMqttReactor
+function ThingsMqtt.reactor() end
+
 --- Converts a Lua value to a JSON string.
 --- @param val any The Lua value to convert.
 --- @return string The JSON string representation of the Lua value.
@@ -28,20 +34,166 @@ function ThingsMqtt:disconnect() end
 --- @return boolean True if the client is connected, false otherwise.
 function ThingsMqtt:is_connected() end
 
+--- @alias ThingsMqttOfflineQueue { entries: integer, bytes: integer, dropped: integer }
+
+--- Gets the occupancy of the queue of telemetry waiting to be published or
+--- acknowledged by the broker.
+--- `dropped` counts entries discarded to stay within the queue's limits.
+--- @return ThingsMqttOfflineQueue
+function ThingsMqtt:offline_queue() end
+
 --- Main loop to be called periodically to process MQTT events.
+--- After reconnecting, queued telemetry is replayed from here, limited to
+--- `replay_window` unacknowledged messages and `replay_rate` messages per second.
+--- A quarter of both is left to live telemetry, which is published right away
+--- rather than waiting for the queue to drain.
+--- Queued payloads are replayed at the QoS level they were sent at, and
+--- consecutive payloads of the same level are merged into messages of up to
+--- `replay_batch_size` bytes.
+--- Also sends pending data when due according to `flush_interval` (ms),
+--- `max_pending_age` (ms) or `max_pending_count`.
+--- @param timeout integer? maximum time to wait for MQTT events in milliseconds, 0 to return immediately, defaults to one second
 --- @return nil
-function ThingsMqtt:loop() end
+function ThingsMqtt:loop(timeout) end
+
+--- Processes MQTT events and timers until `stop()` is called.
+--- Sleeps until the socket is ready or the next timer, flush or replay is due,
+--- so no CPU is used while idle. Use instead of calling `loop()` in a loop.
+function ThingsMqtt:run() end
+
+--- Makes `run()` return, for example from a timer or RPC handler.
+function ThingsMqtt:stop() end
+
+--- Calls a function repeatedly, every interval.
+--- Timers run from `run()`, `loop()`, `loop_misc()` and reactors. Errors raised
+--- by the function are printed and the timer keeps running.
+--- @param ms integer interval in milliseconds
+--- @param fn fun() function to call
+--- @return integer timer_id ID of the timer, for `cancel()`
+function ThingsMqtt:every(ms, fn) end
+
+--- Calls a function once, after a delay.
+--- @param ms integer delay in milliseconds
+--- @param fn fun() function to call
+--- @return integer timer_id ID of the timer, for `cancel()`
+function ThingsMqtt:after(ms, fn) end
+
+--- Cancels a timer added by `every()` or `after()`.
+--- @param timer_id integer
+--- @return boolean cancelled true if the timer was still active
+function ThingsMqtt:cancel(timer_id) end
+
+--- Gets the socket of the MQTT connection, to poll it in an external event loop
+--- such as cqueues, copas or luv instead of calling `loop()`.
+--- Poll it for reading, and for writing while `want_write()` is true, then call
+--- `loop_read()` or `loop_write()`. Call `loop_misc()` at least once a second.
+--- The socket changes after reconnecting.
+--- @return integer? fd the socket, or nil if there is no connection
+function ThingsMqtt:socket() end
+
+--- Checks if there is data waiting to be written to the socket.
+--- @return boolean
+function ThingsMqtt:want_write() end
+
+--- Processes incoming MQTT packets, call when the socket is readable.
+function ThingsMqtt:loop_read() end
+
+--- Writes pending MQTT packets, call when the socket is writable.
+function ThingsMqtt:loop_write() end
+
+--- Sends keepalives, reconnects after the connection is lost, replays queued
+--- telemetry and sends pending data that is due, as `loop()` does without
+--- waiting on the socket. Call at least once a second.
+function ThingsMqtt:loop_misc() end
+
+--- Registers a telemetry key, returning a handle that can be passed to
+--- `telemetry()` instead of the name to avoid looking the key up on every call.
+--- @param key string name of the telemetry data
+--- @return integer The handle of the key.
+function ThingsMqtt:key(key) end
 
 --- Sets telemetry to send to server
---- @param key string name of the telemetry data
+--- When `batch_telemetry` is enabled every call is recorded as a sample,
+--- otherwise only the latest value is sent. Numbers and booleans are stored
+--- without converting them to JSON, so they are the cheapest values to set.
+--- @param key string|integer name of the telemetry data, or a handle from `key()`
 --- @param value any value of the telemetry data
-function ThingsMqtt:telemetry(key, value) end
+--- @param ts number? time the value was measured in milliseconds since the epoch, defaults to now
+function ThingsMqtt:telemetry(key, value, ts) end
+
+--- Sets several telemetry values at once, all measured at the same time.
+--- Equivalent to calling `telemetry()` for each entry, but the table is walked
+--- in a single call. The whole table is checked first, so nothing is set if
+--- any entry is invalid.
+--- @param values table<string|integer, any> values by name, or by handle from `key()`
+--- @param ts number? time the values were measured in milliseconds since the epoch, defaults to now
+function ThingsMqtt:telemetry_batch(values, ts) end
+
+--- @alias ThingsMqttFilter { deadband: number?, deadband_percent: number?, min_interval: integer?, max_silence: integer? }
+
+--- Sets the filter used to suppress insignificant changes of a telemetry key.
+--- `deadband` and `deadband_percent` ignore small numeric changes, `min_interval`
+--- limits how often a value is accepted and `max_silence` forces a value to be
+--- sent after that long without one. Times are in milliseconds.
+--- @param key string name of the telemetry data
+--- @param filter ThingsMqttFilter? filter to apply, or nil to remove the filter
+function ThingsMqtt:set_filter(key, filter) end
+
+--- @alias ThingsMqttAggregation "min"|"max"|"avg"|"count"|"last"
+
+--- Sends statistics of a telemetry key over each send window instead of its
+--- samples. Each statistic is sent as a derived key such as `temp_min`.
+--- @param key string name of the telemetry data
+--- @param modes ThingsMqttAggregation[]? statistics to send, or nil to stop aggregating
+function ThingsMqtt:set_aggregation(key, modes) end
+
+--- Sets the QoS level to publish a telemetry key at, overriding `telemetry_qos`.
+--- Keys at QoS 0 are sent without waiting for acknowledgement and are dropped
+--- rather than queued while offline, suiting fast-changing values.
+--- @param key string name of the telemetry data
+--- @param qos ThingsMqttQos? QoS level, or nil to use `telemetry_qos` again
+function ThingsMqtt:set_qos(key, qos) end
 
 --- Sets an attribute to send to server
+--- Only attributes that differ from the values last acknowledged by the broker
+--- are sent, including after reconnecting. Set `attribute_state_file` to keep
+--- the acknowledged values across restarts.
 --- @param key string name of the attribute
 --- @param value any value of the attribute
 function ThingsMqtt:set_attribute(key, value) end
 
+--- Sets several attributes at once, as if calling `set_attribute()` for each.
+--- The whole table is checked first, so nothing is set if any entry is invalid.
+--- @param values table<string, any> values by attribute name
+function ThingsMqtt:set_attributes(values) end
+
+--- Registers a device to publish data for in gateway mode, announcing it to the
+--- server. All devices share this connection, and their data is combined into
+--- as few messages as possible on each send. Devices are announced again after
+--- reconnecting, paced by `replay_rate`.
+--- @param name string name of the device on the server
+--- @return integer device handle of the device, usable in place of its name
+function ThingsMqtt:device(name) end
+
+--- Sets telemetry values of a gateway device, all measured at the same time.
+--- Only the latest value of each key is kept, and it is sent once connected
+--- rather than queued while offline. Device telemetry is not kept until
+--- acknowledged either, so values in flight when the connection is lost are
+--- not sent again.
+--- @param device string|integer name of the device, or a handle from `device()`
+--- @param values table<string, any> values by name
+--- @param ts number? time the values were measured in milliseconds since the epoch, defaults to now
+function ThingsMqtt:device_telemetry(device, values, ts) end
+
+--- Sets attributes of a gateway device.
+--- They are kept until acknowledged, and after reconnecting only those that
+--- changed since are sent again.
+--- @param device string|integer name of the device, or a handle from `device()`
+--- @param values table<string, any> values by attribute name
+function ThingsMqtt:device_attributes(device, values) end
+
+--- Sends any updated telemetry and attributes.
+--- Telemetry larger than `max_payload_size` is split across several messages.
 function ThingsMqtt:send() end
 
 function ThingsMqtt:add_attribute_handler() end
@@ -60,4 +212,27 @@ function ThingsMqtt:add_rpc_handler(handler) end
 --- @return boolean True if the handler was removed, false otherwise.
 function ThingsMqtt:remove_rpc_handler(handler_id) end
 
+--- Waits on the sockets of many clients at once, so one process can service
+--- any number of connections without calling `loop()` on each of them.
+--- @class ThingsMqttReactor
+local ThingsMqttReactor = {}
+
+--- Adds a client to drive. Its `loop()` should no longer be called.
+--- @param thing ThingsMqtt
+function ThingsMqttReactor:add(thing) end
+
+--- Stops driving a client.
+--- @param thing ThingsMqtt
+--- @return boolean removed true if the client had been added
+function ThingsMqttReactor:remove(thing) end
+
+--- Waits for socket activity, then lets the clients with activity or a due
+--- timer, flush, replay or keepalive process their events, replay queued
+--- telemetry and send pending data as `loop()` does.
+--- Waits end early when a timer, flush or replay of a client is due, and are
+--- capped at one second so that keepalives are sent in time.
+--- @param timeout integer? maximum time to wait in milliseconds, defaults to one second, as does a negative timeout
+--- @return integer ready number of clients that had socket activity
+function ThingsMqttReactor:poll(timeout) end
+
 return ThingsMqtt
@@ -1,7 +1,13 @@
 #include "controller.hpp"
-#include <ctime>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <poll.h>
 #include <sstream>
 #include <stdexcept>
+#include "telemetry-spool.hpp"
 #include "thingsmqtt-config.hpp"
 
 void Controller::connect(const ControllerConfig& config) {
@@ -17,9 +23,52 @@ void Controller::connect(const ControllerConfig& config) {
 		cfg.keepalive = 60;
 	}
 
+	m_batch_telemetry = cfg.batch_telemetry;
+	m_max_payload_size = cfg.max_payload_size;
+	m_flush_interval = cfg.flush_interval;
+	m_max_pending_age = cfg.max_pending_age;
+	m_max_pending_count = cfg.max_pending_count;
+	m_default_telemetry_qos = cfg.telemetry_qos;
+	m_attributes_qos = cfg.attributes_qos;
+	m_replay_window = std::max<size_t>(cfg.replay_window, 1);
+	m_replay_rate = cfg.replay_rate;
+	m_replay_batch_size = cfg.replay_batch_size;
+	if (m_max_payload_size > 0) {
+		m_replay_batch_size = std::min(m_replay_batch_size, m_max_payload_size);
+	}
+
+	// Restore the attributes acknowledged before a restart
+	if (cfg.attribute_state_file != nullptr) {
+		m_attribute_state_file = cfg.attribute_state_file;
+		loadAttributeState();
+	}
+
+	// Create the offline store, keeping anything already queued
+	std::unique_ptr<OfflineStore> offline_store;
+	if (cfg.spool_dir != nullptr) {
+		offline_store = std::make_unique<TelemetrySpool>(
+			cfg.spool_dir, cfg.spool_segment_size, cfg.spool_max_segments);
+	} else {
+		offline_store = std::make_unique<MemoryOfflineStore>(
+			cfg.offline_max_entries, cfg.offline_max_bytes,
+			cfg.offline_overflow);
+	}
+	m_offline_store->rewind();
+	while (m_offline_store->hasPending()) {
+		offline_store->push(m_offline_store->peek(),
+							m_offline_store->peekQos());
+		m_offline_store->advance();
+	}
+	m_offline_store = std::move(offline_store);
+	m_telemetry_in_flight.clear();  // Their entries are replayed instead
+
 	// Set MQTT Callbacks
 	m_mqtt_client.set_connect_callback(
 		[this](MqttConnectRc rc) { this->onMqttConnect(rc); });
+	m_mqtt_client.set_disconnect_callback(
+		[this](MqttConnectRc rc) { this->onMqttDisconnect(rc); });
+	m_mqtt_client.set_publish_callback(
+		[this](int message_id) { this->onMqttPublish(message_id); });
 	m_mqtt_client.set_message_callback([this](int message_id, const char* topic,
 											  std::string_view payload,
 											  MqttQos qos, bool retain) {
@@ -34,26 +83,201 @@ void Controller::connect(const ControllerConfig& config) {
 	} else {
 		m_mqtt_client.connect(cfg.host, cfg.port, cfg.keepalive);
 	}
+	notifyWakeup();
 }
 
 void Controller::disconnect() {
 	m_mqtt_client.disconnect();
+	notifyWakeup();
 }
 
 void Controller::publishTelemetry(const char* key, nlohmann::json&& value) {
-	// Check if the old value is different
-	auto it = m_telemetry_data.find(key);
-	if (it == m_telemetry_data.end()) {
-		// New telemetry key
-		m_telemetry_data.emplace(key, std::move(value));
-		m_tainted_telemetry_keys.insert(key);
-	} else if (it->second != value) {
-		// Existing telemetry key with a new value
-		it->second = std::move(value);
-		m_tainted_telemetry_keys.insert(key);
+	publishTelemetry(key, std::move(value), currentTimestamp());
+}
+
+void Controller::publishTelemetry(const char* key,
+								  nlohmann::json&& value,
+								  int64_t ts) {
+	publishTelemetry(registerTelemetryKey(key), std::move(value), ts);
+}
+
+Controller::TelemetryHandle Controller::registerTelemetryKey(const char* key) {
+	TelemetryHandle handle = m_telemetry.intern(key);
+	if (handle >= m_telemetry_filters.size()) {
+		m_telemetry_filters.resize(m_telemetry.size());
+		m_telemetry_aggregates.resize(m_telemetry.size());
+		m_telemetry_qos.resize(m_telemetry.size());
+	}
+	return handle;
+}
+
+void Controller::publishTelemetry(TelemetryHandle handle,
+								  nlohmann::json&& value) {
+	publishTelemetry(handle, std::move(value), currentTimestamp());
+}
+
+void Controller::publishTelemetry(TelemetryHandle handle,
+								  nlohmann::json&& value,
+								  int64_t ts) {
+	if (!m_telemetry.contains(handle)) {
+		throw std::out_of_range("Invalid telemetry handle");
+	}
+
+	// Aggregated numeric values only update the statistics of the window
+	std::optional<TelemetryAggregate>& aggregate =
+		m_telemetry_aggregates[handle];
+	if (aggregate && value.is_number()) {
+		double number = value.get<double>();
+		if (aggregate->count == 0) {
+			aggregate->min = number;
+			aggregate->max = number;
+			aggregate->sum = 0.0;
+		} else {
+			aggregate->min = std::min(aggregate->min, number);
+			aggregate->max = std::max(aggregate->max, number);
+		}
+		aggregate->sum += number;
+		aggregate->last = number;
+		aggregate->last_ts = ts;
+		++aggregate->count;
+
+		m_telemetry.set(handle, std::move(value), ts);
+		markPending();
+		return;
+	}
+
+	// Check if the new value is different enough from the old value
+	if (m_telemetry.hasValue(handle)) {
+		const std::optional<TelemetryFilter>& filter =
+			m_telemetry_filters[handle];
+		if (filter) {
+			if (!passesFilter(*filter, handle, value, ts)) {
+				return;
+			}
+		} else if (!m_batch_telemetry && m_telemetry.value(handle) == value) {
+			// No change in telemetry value
+			return;
+		}
+	}
+
+	if (m_batch_telemetry) {
+		// Record the sample so that no values are lost between sends,
+		// replacing any earlier sample of the key with the same timestamp
+		auto& samples = m_telemetry_samples[ts];
+		auto sample = std::find_if(
+			samples.begin(), samples.end(),
+			[handle](const auto& sample) { return sample.first == handle; });
+		if (sample != samples.end()) {
+			sample->second = value;
+		} else {
+			samples.emplace_back(handle, value);
+			++m_sample_count;
+		}
 	} else {
+		m_telemetry.markDirty(handle);
+	}
+
+	m_telemetry.set(handle, std::move(value), ts);
+	markPending();
+}
+
+void Controller::publishTelemetryNumber(TelemetryHandle handle,
+										double value,
+										int64_t ts) {
+	if (!m_telemetry.contains(handle)) {
+		throw std::out_of_range("Invalid telemetry handle");
+	}
+	if (!isPlainTelemetry(handle)) {
+		if (TelemetryCache::isIntegral(value)) {
+			publishTelemetry(
+				handle,
+				static_cast<nlohmann::json::number_integer_t>(value), ts);
+		} else {
+			publishTelemetry(handle, value, ts);
+		}
+		return;
+	}
+
+	if (m_telemetry.hasValue(handle) &&
+		m_telemetry.equalsNumber(handle, value)) {
 		// No change in telemetry value
+		return;
 	}
+	m_telemetry.markDirty(handle);
+	m_telemetry.setNumber(handle, value, ts);
+	markPending();
+}
+
+void Controller::publishTelemetryBool(TelemetryHandle handle,
+									  bool value,
+									  int64_t ts) {
+	if (!m_telemetry.contains(handle)) {
+		throw std::out_of_range("Invalid telemetry handle");
+	}
+	if (!isPlainTelemetry(handle)) {
+		publishTelemetry(handle, value, ts);
+		return;
+	}
+
+	if (m_telemetry.hasValue(handle) && m_telemetry.equalsBool(handle, value)) {
+		// No change in telemetry value
+		return;
+	}
+	m_telemetry.markDirty(handle);
+	m_telemetry.setBool(handle, value, ts);
+	markPending();
+}
+
+void Controller::setTelemetryFilter(const char* key,
+									const TelemetryFilter& filter) {
+	m_telemetry_filters[registerTelemetryKey(key)] = filter;
+}
+
+bool Controller::clearTelemetryFilter(const char* key) {
+	std::optional<TelemetryFilter>& filter =
+		m_telemetry_filters[registerTelemetryKey(key)];
+	bool had_filter = filter.has_value();
+	filter.reset();
+	return had_filter;
+}
+
+void Controller::setTelemetryAggregation(const char* key, uint8_t modes) {
+	static const char* const suffixes[] = {"_min", "_max", "_avg", "_count",
+										   "_last"};
+
+	TelemetryHandle handle = registerTelemetryKey(key);
+	auto it = std::find(m_aggregated_handles.begin(),
+						m_aggregated_handles.end(), handle);
+
+	if (modes == AggregateNone) {
+		m_telemetry_aggregates[handle].reset();
+		if (it != m_aggregated_handles.end()) {
+			m_aggregated_handles.erase(it);
+		}
+		return;
+	}
+
+	// Register the derived keys first, as that can grow the aggregate vector
+	TelemetryAggregate aggregate{modes};
+	for (size_t i = 0; i < aggregate.derived.size(); ++i) {
+		if (modes & (1 << i)) {
+			std::string derived_key = std::string(key) + suffixes[i];
+			aggregate.derived[i] = registerTelemetryKey(derived_key.c_str());
+		}
+	}
+
+	m_telemetry_aggregates[handle] = aggregate;
+	if (it == m_aggregated_handles.end()) {
+		m_aggregated_handles.push_back(handle);
+	}
+}
+
+void Controller::setTelemetryQos(const char* key, MqttQos qos) {
+	m_telemetry_qos[registerTelemetryKey(key)] = qos;
+}
+
+void Controller::clearTelemetryQos(const char* key) {
+	m_telemetry_qos[registerTelemetryKey(key)].reset();
 }
 
 void Controller::setAttribute(const char* key, nlohmann::json&& value) {
@@ -63,48 +287,345 @@ void Controller::setAttribute(const char* key, nlohmann::json&& value) {
 		// New attribute key
 		m_attribute_data.emplace(key, std::move(value));
 		m_tainted_attribute_keys.insert(key);
+		markPending();
 	} else if (it->second != value) {
 		// Existing attribute key with a new value
 		it->second = std::move(value);
 		m_tainted_attribute_keys.insert(key);
+		markPending();
 	} else {
 		// No change in attribute value
 	}
 }
 
+Controller::DeviceHandle Controller::registerDevice(const char* name) {
+	auto [it, inserted] = m_device_index.try_emplace(name, m_devices.size());
+	if (inserted) {
+		GatewayDevice& device = m_devices.emplace_back();
+		device.name = name;
+		device.quoted_name = nlohmann::json(device.name).dump();
+		m_device_dirty.push_back(false);
+
+		if (m_mqtt_client.is_connected()) {
+			m_unannounced_devices.push_back(it->second);
+			announceDevices();
+			notifyWakeup();
+		}
+	}
+	return it->second;
+}
+
+void Controller::publishDeviceTelemetry(DeviceHandle device,
+										const char* key,
+										nlohmann::json&& value,
+										int64_t ts) {
+	if (!isDevice(device)) {
+		throw std::out_of_range("Invalid device handle");
+	}
+
+	TelemetryCache& telemetry = m_devices[device].telemetry;
+	TelemetryHandle handle = telemetry.intern(key);
+	if (telemetry.hasValue(handle) && telemetry.value(handle) == value) {
+		// No change in telemetry value
+		return;
+	}
+
+	if (!telemetry.isDirty(handle)) {
+		telemetry.markDirty(handle);
+		++m_device_pending_count;
+	}
+	telemetry.set(handle, std::move(value), ts);
+	markDeviceDirty(device);
+}
+
+void Controller::setDeviceAttribute(DeviceHandle device,
+									const char* key,
+									nlohmann::json&& value) {
+	if (!isDevice(device)) {
+		throw std::out_of_range("Invalid device handle");
+	}
+
+	GatewayDevice& gateway_device = m_devices[device];
+	auto it = gateway_device.attributes.find(key);
+	if (it == gateway_device.attributes.end()) {
+		gateway_device.attributes.emplace(key, std::move(value));
+	} else if (it->second != value) {
+		it->second = std::move(value);
+	} else {
+		// No change in attribute value
+		return;
+	}
+
+	if (gateway_device.tainted_attributes.insert(key).second) {
+		++m_device_pending_count;
+	}
+	markDeviceDirty(device);
+}
+
+void Controller::markDeviceDirty(DeviceHandle device) {
+	if (!m_device_dirty[device]) {
+		m_device_dirty[device] = true;
+		m_dirty_devices.push_back(device);
+	}
+	markPending();
+}
+
+bool Controller::connectDevice(const GatewayDevice& device) {
+	std::string payload = "{\"device\":" + device.quoted_name + "}";
+	return m_mqtt_client.publish(THINGSMQTT_GATEWAY_CONNECT_TOPIC, payload);
+}
+
+void Controller::announceDevices() {
+	if (m_unannounced_devices.empty() || !m_mqtt_client.is_connected()) {
+		return;
+	}
+
+	// Announcements take their share of the rate along with the replay
+	refillReplayTokens();
+	double min_tokens = 1.0 + liveReserve();
+	while (!m_unannounced_devices.empty() &&
+		   (m_replay_rate <= 0.0 || m_replay_tokens >= min_tokens)) {
+		if (!connectDevice(m_devices[m_unannounced_devices.front()])) {
+			break;	// Disconnected again, all are announced on reconnect
+		}
+		m_unannounced_devices.pop_front();
+		if (m_replay_rate > 0.0) {
+			m_replay_tokens -= 1.0;
+		}
+	}
+}
+
+bool Controller::sendDeviceData() {
+	// Device data is kept until connected, as it only holds the latest values
+	if (m_dirty_devices.empty() || !m_mqtt_client.is_connected()) {
+		return false;
+	}
+
+	auto publish_telemetry = [this]() {
+		m_gateway_buffer.push_back('}');
+		m_mqtt_client.publish(THINGSMQTT_GATEWAY_TELEMETRY_TOPIC,
+							  m_gateway_buffer, m_default_telemetry_qos);
+		m_gateway_buffer.assign(1, '{');
+	};
+
+	// Write the telemetry of each device as an array of timestamped entries,
+	// keyed by the device name. Unlike the controller's own telemetry, it
+	// isn't kept in the offline store until acknowledged, as the replay merges
+	// entries in the device telemetry format.
+	m_gateway_buffer.assign(1, '{');
+	for (DeviceHandle handle : m_dirty_devices) {
+		TelemetryCache& telemetry = m_devices[handle].telemetry;
+		if (telemetry.dirtyCount() == 0) {
+			continue;
+		}
+
+		m_flush_handles.clear();
+		telemetry.forEachDirty(
+			[this](TelemetryHandle key) { m_flush_handles.push_back(key); });
+		std::stable_sort(m_flush_handles.begin(), m_flush_handles.end(),
+						 [&telemetry](TelemetryHandle a, TelemetryHandle b) {
+							 return telemetry.timestamp(a) <
+									telemetry.timestamp(b);
+						 });
+		m_telemetry_writer.begin(true);
+		for (TelemetryHandle key : m_flush_handles) {
+			m_telemetry_writer.add(telemetry.timestamp(key),
+								   telemetry.quotedKey(key),
+								   telemetry.value(key));
+		}
+		std::string_view entries = m_telemetry_writer.finish();
+		const std::string& name = m_devices[handle].quoted_name;
+
+		// Publish the devices written so far if this one doesn't fit. A single
+		// device that is too large is still sent.
+		if (m_max_payload_size > 0 && m_gateway_buffer.size() > 1 &&
+			m_gateway_buffer.size() + name.size() + entries.size() + 3 >
+				m_max_payload_size) {
+			publish_telemetry();
+		}
+		if (m_gateway_buffer.size() > 1) {
+			m_gateway_buffer.push_back(',');
+		}
+		m_gateway_buffer.append(name);
+		m_gateway_buffer.push_back(':');
+		m_gateway_buffer.append(entries);
+
+		telemetry.clearDirty();
+	}
+	if (m_gateway_buffer.size() > 1) {
+		publish_telemetry();
+	}
+
+	// Keep the attributes of each payload until the broker acknowledges them,
+	// as sendAttributes() does
+	DeviceAttributes attributes;
+	auto publish_attributes = [this, &attributes]() {
+		m_gateway_buffer.push_back('}');
+		int message_id;
+		if (m_mqtt_client.publish(THINGSMQTT_GATEWAY_ATTRIBUTES_TOPIC,
+								  m_gateway_buffer, m_attributes_qos,
+								  &message_id)) {
+			if (m_attributes_qos == MqttQos::AtMostOnce) {
+				ackDeviceAttributes(attributes);
+			} else {
+				m_device_attributes_in_flight.insert_or_assign(
+					message_id, std::move(attributes));
+			}
+		}
+		attributes.clear();
+		m_gateway_buffer.assign(1, '{');
+	};
+
+	// Write the attributes of each device the broker doesn't already have as
+	// an object keyed by device name
+	for (DeviceHandle handle : m_dirty_devices) {
+		GatewayDevice& device = m_devices[handle];
+		nlohmann::json attribute_values = nlohmann::json::object();
+		for (const auto& key : device.tainted_attributes) {
+			const nlohmann::json& value = device.attributes[key];
+			auto acked = device.acked_attributes.find(key);
+			if (acked == device.acked_attributes.end() ||
+				acked->second != value) {
+				attribute_values[key] = value;
+			}
+		}
+		device.tainted_attributes.clear();
+		if (attribute_values.empty()) {
+			continue;
+		}
+		std::string entries = attribute_values.dump();
+
+		if (m_max_payload_size > 0 && m_gateway_buffer.size() > 1 &&
+			m_gateway_buffer.size() + device.quoted_name.size() +
+					entries.size() + 3 >
+				m_max_payload_size) {
+			publish_attributes();
+		}
+		if (m_gateway_buffer.size() > 1) {
+			m_gateway_buffer.push_back(',');
+		}
+		m_gateway_buffer.append(device.quoted_name);
+		m_gateway_buffer.push_back(':');
+		m_gateway_buffer.append(entries);
+		attributes.emplace_back(handle, std::move(attribute_values));
+	}
+	if (m_gateway_buffer.size() > 1) {
+		publish_attributes();
+	}
+
+	for (DeviceHandle handle : m_dirty_devices) {
+		m_device_dirty[handle] = false;
+	}
+	m_dirty_devices.clear();
+	m_device_pending_count = 0;
+
+	return true;
+}
+
 bool Controller::send() {
 	bool data_to_send = false;
 
-	if (!m_tainted_telemetry_keys.empty()) {
-		// Create a JSON object for the telemetry values
-		nlohmann::json telemetry_values;
-		for (const auto& key : m_tainted_telemetry_keys) {
-			telemetry_values[key] = m_telemetry_data[key];
+	flushAggregates();
+
+	if (!m_telemetry_samples.empty()) {
+		// Find the QoS levels of the samples
+		bool used_qos[3] = {false, false, false};
+		for (const auto& [ts, samples] : m_telemetry_samples) {
+			for (const auto& [handle, value] : samples) {
+				used_qos[static_cast<size_t>(telemetryQos(handle))] = true;
+			}
+		}
+
+		// Write an array of timestamped samples for each QoS level
+		for (size_t level = 0; level < 3; ++level) {
+			if (!used_qos[level]) {
+				continue;
+			}
+			MqttQos qos = static_cast<MqttQos>(level);
+			m_telemetry_writer.begin(true);
+			for (const auto& [ts, samples] : m_telemetry_samples) {
+				for (const auto& [handle, value] : samples) {
+					if (telemetryQos(handle) == qos) {
+						writeTelemetry(ts, handle, value, true, qos);
+					}
+				}
+			}
+
+			// Publish the telemetry data
+			sendTelemetry(m_telemetry_writer.finish(), qos);
 		}
 
-		// Create the JSON payload
-		nlohmann::json payload;
-		payload["values"] = telemetry_values;
-		payload["ts"] = std::time(nullptr) * 1000;
+		// Clear the recorded samples
+		m_telemetry_samples.clear();
+		m_sample_count = 0;
 
-		// Publish the telemetry data
-		sendTelemetry(std::move(payload));
+		data_to_send = true;
+	}
+
+	if (m_telemetry.dirtyCount() > 0) {
+		// Group the telemetry values by QoS level, then by the time they were
+		// measured
+		m_flush_handles.clear();
+		m_telemetry.forEachDirty(
+			[this](TelemetryHandle handle) { m_flush_handles.push_back(handle); });
+		std::stable_sort(m_flush_handles.begin(), m_flush_handles.end(),
+						 [this](TelemetryHandle a, TelemetryHandle b) {
+							 MqttQos qos_a = telemetryQos(a);
+							 MqttQos qos_b = telemetryQos(b);
+							 if (qos_a != qos_b) {
+								 return qos_a < qos_b;
+							 }
+							 return m_telemetry.timestamp(a) <
+									m_telemetry.timestamp(b);
+						 });
+
+		auto group_start = m_flush_handles.begin();
+		while (group_start != m_flush_handles.end()) {
+			MqttQos qos = telemetryQos(*group_start);
+			auto group_end = std::find_if(
+				group_start, m_flush_handles.end(),
+				[this, qos](TelemetryHandle handle) {
+					return telemetryQos(handle) != qos;
+				});
+
+			// Write the payload, only using an array when the values were
+			// measured at different times
+			bool array = m_telemetry.timestamp(*group_start) !=
+						 m_telemetry.timestamp(*(group_end - 1));
+			m_telemetry_writer.begin(array);
+			for (auto it = group_start; it != group_end; ++it) {
+				writeTelemetry(m_telemetry.timestamp(*it), *it,
+							   m_telemetry.value(*it), array, qos);
+			}
+
+			// Publish the telemetry data
+			sendTelemetry(m_telemetry_writer.finish(), qos);
+
+			group_start = group_end;
+		}
 
 		// Clear the tainted keys
-		m_tainted_telemetry_keys.clear();
+		m_telemetry.clearDirty();
 
 		data_to_send = true;
 	}
 
 	if (!m_tainted_attribute_keys.empty()) {
-		// Create a JSON object for the attribute values
-		nlohmann::json attribute_values;
+		// Create a JSON object for the attribute values the broker doesn't
+		// already have
+		nlohmann::json attribute_values = nlohmann::json::object();
 		for (const auto& key : m_tainted_attribute_keys) {
-			attribute_values[key] = m_attribute_data[key];
+			const nlohmann::json& value = m_attribute_data[key];
+			auto acked = m_acked_attributes.find(key);
+			if (acked == m_acked_attributes.end() || acked->second != value) {
+				attribute_values[key] = value;
+			}
 		}
 
 		// Publish the attribute data
-		sendAttributes(std::move(attribute_values));
+		if (!attribute_values.empty()) {
+			sendAttributes(std::move(attribute_values));
+		}
 
 		// Clear the tainted keys
 		m_tainted_attribute_keys.clear();
@@ -112,11 +633,146 @@ bool Controller::send() {
 		data_to_send = true;
 	}
 
+	if (sendDeviceData()) {
+		data_to_send = true;
+	}
+
+	m_last_flush = steadyTimestamp();
+	// Device data waits for the connection, so is still pending
+	m_first_pending = m_dirty_devices.empty() ? 0 : m_last_flush;
+
+	// Publishing may have left data waiting to be written to the socket
+	notifyWakeup();
+
 	return data_to_send;
 }
 
-void Controller::loop() {
-	m_mqtt_client.loop();
+void Controller::loop(int timeout_ms) {
+	m_mqtt_client.loop(timeout_ms);
+	processPending();
+}
+
+void Controller::loopMisc() {
+	m_mqtt_client.loop_misc();
+	processPending();
+}
+
+void Controller::processPending() {
+	m_timers.runDue(steadyTimestamp());
+
+	announceDevices();
+	replayOfflineTelemetry();
+
+	if (isFlushDue()) {
+		send();
+	}
+}
+
+size_t Controller::addTimer(int64_t delay_ms,
+							int64_t interval_ms,
+							TimerHeap::Callback callback) {
+	size_t timer_id =
+		m_timers.add(steadyTimestamp() + std::max<int64_t>(delay_ms, 0),
+					 interval_ms, std::move(callback));
+	notifyWakeup();
+	return timer_id;
+}
+
+void Controller::run() {
+	m_running = true;
+	while (m_running) {
+		int timeout_ms = nextWakeup(steadyTimestamp());
+
+		// Sleep until the socket is ready or something else is due. Without a
+		// socket, e.g. before connecting, only the timeout is waited for.
+		struct pollfd pfd {};
+		pfd.fd = m_mqtt_client.socket();
+		int ready = 0;
+		if (pfd.fd >= 0) {
+			pfd.events = POLLIN;
+			if (m_mqtt_client.want_write()) {
+				pfd.events |= POLLOUT;
+			}
+			ready = ::poll(&pfd, 1, timeout_ms);
+		} else {
+			::poll(nullptr, 0, timeout_ms);
+		}
+
+		if (ready > 0) {
+			if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+				m_mqtt_client.loop_read();
+			}
+			if ((pfd.revents & POLLOUT) && m_mqtt_client.socket() == pfd.fd) {
+				m_mqtt_client.loop_write();
+			}
+		}
+		loopMisc();
+	}
+}
+
+int Controller::nextWakeup(int64_t now) {
+	if (isFlushDue()) {
+		return 0;
+	}
+
+	int64_t wakeup = now + 1000;
+
+	if (std::optional<int64_t> timer = m_timers.nextDue()) {
+		wakeup = std::min(wakeup, *timer);
+	}
+	if (m_first_pending != 0) {
+		if (m_flush_interval > 0) {
+			wakeup = std::min(wakeup, m_last_flush + m_flush_interval);
+		}
+		if (m_max_pending_age > 0) {
+			wakeup = std::min(wakeup, m_first_pending + m_max_pending_age);
+		}
+	}
+
+	// Wake up when the next replay token is available
+	double replay_tokens = 1.0 + liveReserve();
+	if (m_replay_rate > 0.0 && m_replay_tokens < replay_tokens &&
+		m_mqtt_client.is_connected() &&
+		(m_offline_store->hasPending() || !m_unannounced_devices.empty())) {
+		int64_t refill = static_cast<int64_t>(std::ceil(
+			(replay_tokens - m_replay_tokens) * 1000.0 / m_replay_rate));
+		wakeup = std::min(wakeup, m_replay_refill_ts + refill);
+	}
+
+	return static_cast<int>(std::max<int64_t>(wakeup - now, 0));
+}
+
+int64_t Controller::currentTimestamp() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			   std::chrono::system_clock::now().time_since_epoch())
+		.count();
+}
+
+int64_t Controller::steadyTimestamp() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+bool Controller::isFlushDue() const {
+	if (m_first_pending == 0) {
+		return false;  // Nothing to send
+	}
+
+	int64_t now = steadyTimestamp();
+	if (m_flush_interval > 0 && now - m_last_flush >= m_flush_interval) {
+		return true;
+	}
+	if (m_max_pending_age > 0 && now - m_first_pending >= m_max_pending_age) {
+		return true;
+	}
+	if (m_max_pending_count > 0 &&
+		m_telemetry.dirtyCount() + m_sample_count +
+				m_tainted_attribute_keys.size() + m_device_pending_count >=
+			m_max_pending_count) {
+		return true;
+	}
+	return false;
 }
 
 size_t Controller::addRpcHandler(RpcHandler handler) {
@@ -129,26 +785,156 @@ bool Controller::removeRpcHandler(size_t handler_id) {
 	return m_rpc_handlers.erase(handler_id) > 0;
 }
 
-void Controller::sendTelemetry(nlohmann::json&& payload) {
-	// If we are connected, publish immediately
-	if (m_mqtt_client.is_connected()) {
-		m_mqtt_client.publish(THINGSMQTT_TELEMETRY_TOPIC, payload.dump());
-	} else {
-		// Queue the telemetry data for later sending
-		m_pending_telemetry.push_back(payload.dump());
+void Controller::sendTelemetry(std::string_view payload, MqttQos qos) {
+	// Fire and forget telemetry is only sent if we are connected
+	if (qos == MqttQos::AtMostOnce) {
+		if (m_mqtt_client.is_connected() &&
+			m_mqtt_client.publish(THINGSMQTT_TELEMETRY_TOPIC, payload, qos) &&
+			m_replay_rate > 0.0) {
+			m_replay_tokens -= 1.0;
+		}
+		return;
+	}
+
+	// Keep the payload in the offline store until the broker acknowledges it
+	bool replaying = m_offline_store->hasPending();
+	std::optional<uint64_t> id =
+		m_offline_store->push(payload, static_cast<uint8_t>(qos));
+	if (!id || !m_mqtt_client.is_connected()) {
+		return;
+	}
+
+	// While replaying, the replay leaves part of the window and rate free so
+	// that new data isn't held up behind the backlog. Once that is used up,
+	// the entry is replayed along with the backlog.
+	if (replaying &&
+		(m_telemetry_in_flight.size() >= m_replay_window ||
+		 (m_replay_rate > 0.0 && m_replay_tokens < 1.0))) {
+		return;
+	}
+
+	int message_id;
+	if (m_mqtt_client.publish(THINGSMQTT_TELEMETRY_TOPIC, payload, qos,
+							  &message_id)) {
+		m_offline_store->markPublished(*id);
+		m_telemetry_in_flight[message_id].push_back(*id);
+
+		// Live telemetry isn't rate limited, but counts towards the rate so
+		// the replay slows down to make room for it
+		if (m_replay_rate > 0.0) {
+			m_replay_tokens -= 1.0;
+		}
 	}
 }
 
 void Controller::sendAttributes(nlohmann::json&& payload) {
-	// If we are connected, publish immediately
-	if (m_mqtt_client.is_connected()) {
-		m_mqtt_client.publish(THINGSMQTT_ATTRIBUTES_TOPIC, payload.dump());
-	} else {
-		// All attributes must be sent when connected, so we'll just send the
-		// latest then
+	// Any attributes that weren't acknowledged are sent when connected
+	if (!m_mqtt_client.is_connected()) {
+		return;
+	}
+
+	// Fire and forget attributes have no acknowledgement to wait for, and
+	// on_publish may already have been called from within publish()
+	if (m_attributes_qos == MqttQos::AtMostOnce) {
+		if (m_mqtt_client.publish(THINGSMQTT_ATTRIBUTES_TOPIC, payload.dump(),
+								  m_attributes_qos)) {
+			ackAttributes(payload);
+		}
+		return;
+	}
+
+	// Otherwise keep the payload until the broker acknowledges it, which is
+	// only reported by a later loop
+	int message_id;
+	if (m_mqtt_client.publish(THINGSMQTT_ATTRIBUTES_TOPIC, payload.dump(),
+							  m_attributes_qos, &message_id)) {
+		m_attributes_in_flight.insert_or_assign(message_id, std::move(payload));
 	}
 }
 
+void Controller::flushAggregates() {
+	for (TelemetryHandle handle : m_aggregated_handles) {
+		TelemetryAggregate& aggregate = *m_telemetry_aggregates[handle];
+		if (aggregate.count == 0) {
+			continue;
+		}
+
+		// The derived values are timestamped with the last sample
+		int64_t ts = aggregate.last_ts;
+		if (aggregate.modes & AggregateMin) {
+			publishTelemetry(aggregate.derived[0], aggregate.min, ts);
+		}
+		if (aggregate.modes & AggregateMax) {
+			publishTelemetry(aggregate.derived[1], aggregate.max, ts);
+		}
+		if (aggregate.modes & AggregateAvg) {
+			publishTelemetry(aggregate.derived[2],
+							 aggregate.sum / aggregate.count, ts);
+		}
+		if (aggregate.modes & AggregateCount) {
+			publishTelemetry(aggregate.derived[3], aggregate.count, ts);
+		}
+		if (aggregate.modes & AggregateLast) {
+			publishTelemetry(aggregate.derived[4], aggregate.last, ts);
+		}
+
+		aggregate.count = 0;
+	}
+}
+
+void Controller::writeTelemetry(int64_t ts,
+								TelemetryHandle handle,
+								const nlohmann::json& value,
+								bool array,
+								MqttQos qos) {
+	TelemetryWriter::Checkpoint checkpoint = m_telemetry_writer.checkpoint();
+	const std::string& key = m_telemetry.quotedKey(handle);
+	m_telemetry_writer.add(ts, key, value);
+
+	// If the value made the payload too large, publish the payload without it
+	// and start a new one. A single value that is too large is still sent.
+	if (m_max_payload_size > 0 &&
+		m_telemetry_writer.finishedSize() > m_max_payload_size &&
+		!checkpoint.empty()) {
+		m_telemetry_writer.rollback(checkpoint);
+		sendTelemetry(m_telemetry_writer.finish(), qos);
+
+		m_telemetry_writer.begin(array);
+		m_telemetry_writer.add(ts, key, value);
+	}
+}
+
+bool Controller::passesFilter(const TelemetryFilter& filter,
+							  TelemetryHandle handle,
+							  const nlohmann::json& value,
+							  int64_t ts) const {
+	const nlohmann::json& last_value = m_telemetry.value(handle);
+	int64_t elapsed = ts - m_telemetry.timestamp(handle);
+
+	// Send a heartbeat if the key has been silent for too long
+	if (filter.max_silence > 0 && elapsed >= filter.max_silence) {
+		return true;
+	}
+	if (filter.min_interval > 0 && elapsed < filter.min_interval) {
+		return false;
+	}
+
+	// Apply the deadbands to numeric values
+	if (value.is_number() && last_value.is_number()) {
+		double old_value = last_value.get<double>();
+		double delta = std::fabs(value.get<double>() - old_value);
+		if (filter.deadband > 0.0 && delta <= filter.deadband) {
+			return false;
+		}
+		if (filter.deadband_percent > 0.0 &&
+			delta <= std::fabs(old_value) * filter.deadband_percent / 100.0) {
+			return false;
+		}
+	}
+
+	return value != last_value;
+}
+
 void Controller::onMqttConnect(MqttConnectRc rc) {
 	if (rc != MqttConnectRc::Accepted) {
 		// Connection failed
@@ -158,20 +944,220 @@ void Controller::onMqttConnect(MqttConnectRc rc) {
 	// Subscribe to topics
 	m_mqtt_client.subscribe(THINGSMQTT_RPC_TOPIC "/+", MqttQos::ExactlyOnce);
 
-	// Send all attributes
-	if (!m_attribute_data.empty()) {
-		nlohmann::json attribute_values;
-		for (const auto& [key, value] : m_attribute_data) {
+	// Send the attributes that changed since they were last acknowledged
+	m_attributes_in_flight.clear();
+	nlohmann::json attribute_values = nlohmann::json::object();
+	for (const auto& [key, value] : m_attribute_data) {
+		auto acked = m_acked_attributes.find(key);
+		if (acked == m_acked_attributes.end() || acked->second != value) {
 			attribute_values[key] = value;
 		}
+	}
+	if (!attribute_values.empty()) {
 		sendAttributes(std::move(attribute_values));
 	}
 
-	// Send any pending telemetry data
-	while (!m_pending_telemetry.empty()) {
-		const std::string& payload = m_pending_telemetry.front();
-		m_mqtt_client.publish(THINGSMQTT_TELEMETRY_TOPIC, payload);
-		m_pending_telemetry.pop_front();
+	// Send the device attributes that changed since they were last
+	// acknowledged
+	m_device_attributes_in_flight.clear();
+	for (DeviceHandle handle = 0; handle < m_devices.size(); ++handle) {
+		GatewayDevice& device = m_devices[handle];
+		bool changed = false;
+		for (const auto& [key, value] : device.attributes) {
+			auto acked = device.acked_attributes.find(key);
+			if (acked != device.acked_attributes.end() &&
+				acked->second == value) {
+				continue;
+			}
+			if (device.tainted_attributes.insert(key).second) {
+				++m_device_pending_count;
+			}
+			changed = true;
+		}
+		if (changed) {
+			markDeviceDirty(handle);
+		}
+	}
+
+	// Start replaying any pending telemetry data from loop(), including
+	// anything that was published but not acknowledged before
+	m_offline_store->rewind();
+	m_telemetry_in_flight.clear();
+	m_replay_tokens = static_cast<double>(m_replay_window);
+	m_replay_refill_ts = steadyTimestamp();
+
+	// Announce the gateway devices again, paced along with the replay
+	m_unannounced_devices.clear();
+	for (DeviceHandle handle = 0; handle < m_devices.size(); ++handle) {
+		m_unannounced_devices.push_back(handle);
+	}
+	announceDevices();
+}
+
+void Controller::onMqttDisconnect(MqttConnectRc rc) {
+	m_attributes_in_flight.clear();
+	m_device_attributes_in_flight.clear();
+	m_telemetry_in_flight.clear();
+	m_offline_store->rewind();
+}
+
+void Controller::onMqttPublish(int message_id) {
+	auto attributes = m_attributes_in_flight.find(message_id);
+	if (attributes != m_attributes_in_flight.end()) {
+		ackAttributes(attributes->second);
+		m_attributes_in_flight.erase(attributes);
+		return;
+	}
+
+	auto device_attributes = m_device_attributes_in_flight.find(message_id);
+	if (device_attributes != m_device_attributes_in_flight.end()) {
+		ackDeviceAttributes(device_attributes->second);
+		m_device_attributes_in_flight.erase(device_attributes);
+		return;
+	}
+
+	auto telemetry = m_telemetry_in_flight.find(message_id);
+	if (telemetry != m_telemetry_in_flight.end()) {
+		for (uint64_t id : telemetry->second) {
+			m_offline_store->ack(id);
+		}
+		m_telemetry_in_flight.erase(telemetry);
+	}
+}
+
+void Controller::ackAttributes(const nlohmann::json& attributes) {
+	for (const auto& [key, value] : attributes.items()) {
+		m_acked_attributes[key] = value;
+
+		// The attribute may have changed again while this was in flight
+		auto it = m_attribute_data.find(key);
+		if (it != m_attribute_data.end() && it->second != value) {
+			m_tainted_attribute_keys.insert(key);
+			markPending();
+		}
+	}
+
+	if (!m_attribute_state_file.empty()) {
+		saveAttributeState();
+	}
+}
+
+void Controller::ackDeviceAttributes(const DeviceAttributes& attributes) {
+	for (const auto& [handle, values] : attributes) {
+		GatewayDevice& device = m_devices[handle];
+		for (const auto& [key, value] : values.items()) {
+			device.acked_attributes[key] = value;
+
+			// The attribute may have changed again while this was in flight
+			if (device.attributes[key] != value &&
+				device.tainted_attributes.insert(key).second) {
+				++m_device_pending_count;
+				markDeviceDirty(handle);
+			}
+		}
+	}
+}
+
+void Controller::loadAttributeState() {
+	std::ifstream file(m_attribute_state_file);
+	if (!file) {
+		return;	 // Nothing saved yet
+	}
+
+	nlohmann::json state = nlohmann::json::parse(file, nullptr, false);
+	if (!state.is_object()) {
+		return;	 // Corrupt, resend everything
+	}
+	for (auto& [key, value] : state.items()) {
+		m_acked_attributes[key] = std::move(value);
+	}
+}
+
+void Controller::saveAttributeState() const {
+	nlohmann::json state = nlohmann::json::object();
+	for (const auto& [key, value] : m_acked_attributes) {
+		state[key] = value;
+	}
+
+	// Write to a temporary file first, so a crash can't leave a partial file
+	std::string temp_file = m_attribute_state_file + ".tmp";
+	{
+		std::ofstream file(temp_file, std::ios::trunc);
+		if (!file) {
+			return;
+		}
+		file << state.dump();
+		if (!file) {
+			return;
+		}
+	}
+	std::rename(temp_file.c_str(), m_attribute_state_file.c_str());
+}
+
+void Controller::replayOfflineTelemetry() {
+	if (!m_mqtt_client.is_connected() || !m_offline_store->hasPending()) {
+		return;
+	}
+
+	refillReplayTokens();
+
+	// Leave part of the window and rate to live telemetry
+	size_t reserve = liveReserve();
+	while (m_offline_store->hasPending() &&
+		   m_telemetry_in_flight.size() + reserve < m_replay_window &&
+		   (m_replay_rate <= 0.0 || m_replay_tokens >= 1.0 + reserve)) {
+		// Merge consecutive entries of the same QoS level into one array
+		// payload while they fit. Each entry is either a single object or an
+		// array of objects.
+		uint8_t qos = m_offline_store->peekQos();
+		std::string_view first = m_offline_store->peek();
+		std::vector<uint64_t> ids{m_offline_store->advance()};
+		std::string_view payload = first;
+		if (m_offline_store->hasPending() &&
+			m_offline_store->peekQos() == qos &&
+			first.size() + m_offline_store->peek().size() + 1 <
+				m_replay_batch_size) {
+			m_replay_buffer.assign(1, '[');
+			TelemetryWriter::appendArrayElements(m_replay_buffer, first);
+			while (m_offline_store->hasPending() &&
+				   m_offline_store->peekQos() == qos) {
+				std::string_view next = m_offline_store->peek();
+				if (m_replay_buffer.size() + next.size() + 2 >
+					m_replay_batch_size) {
+					break;
+				}
+				m_replay_buffer.push_back(',');
+				TelemetryWriter::appendArrayElements(m_replay_buffer, next);
+				ids.push_back(m_offline_store->advance());
+			}
+			m_replay_buffer.push_back(']');
+			payload = m_replay_buffer;
+		}
+
+		int message_id;
+		if (!m_mqtt_client.publish(THINGSMQTT_TELEMETRY_TOPIC, payload,
+								   static_cast<MqttQos>(qos), &message_id)) {
+			// Disconnected again, keep the rest for later
+			m_offline_store->rewind();
+			m_telemetry_in_flight.clear();
+			break;
+		}
+		m_telemetry_in_flight[message_id] = std::move(ids);
+		if (m_replay_rate > 0.0) {
+			m_replay_tokens -= 1.0;
+		}
+	}
+}
+
+void Controller::refillReplayTokens() {
+	// Allow bursts of up to a window of messages
+	if (m_replay_rate > 0.0) {
+		int64_t now = steadyTimestamp();
+		m_replay_tokens =
+			std::min(static_cast<double>(m_replay_window),
+					 m_replay_tokens +
+						 (now - m_replay_refill_ts) * m_replay_rate / 1000.0);
+		m_replay_refill_ts = now;
 	}
 }
 
@@ -1,11 +1,23 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
 #include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 #include "mqtt/mqtt-client-singlethread.hpp"
+#include "offline-store.hpp"
+#include "telemetry-cache.hpp"
+#include "telemetry-writer.hpp"
+#include "timer-heap.hpp"
 
 struct ControllerConfig {
 	const char* host{nullptr};
@@ -17,6 +29,90 @@ struct ControllerConfig {
 	const char* username{nullptr};
 	const char* password{nullptr};
 	MqttSslConfig ssl_config;
+
+	// Record every telemetry sample and publish them as a timestamped array
+	// instead of only the latest value per key
+	bool batch_telemetry{false};
+
+	// Largest telemetry payload to publish in bytes, 0 for no limit.
+	// Larger flushes are split across several messages.
+	size_t max_payload_size{0};
+
+	// Policies for loop() to call send() automatically, 0 disables a policy.
+	// Send at most this often while there is data to send (ms)
+	int64_t flush_interval{0};
+	// Send once the oldest unsent value is this old (ms)
+	int64_t max_pending_age{0};
+	// Send once this many keys or samples are waiting to be sent
+	size_t max_pending_count{0};
+
+	// Limits of the telemetry queued in memory while offline, 0 for no limit
+	size_t offline_max_entries{0};
+	size_t offline_max_bytes{0};
+	OverflowPolicy offline_overflow{OverflowPolicy::DropOldest};
+
+	// Pacing of the replay of queued telemetry after reconnecting. The rate
+	// also paces the announcements of gateway devices. A quarter of the window
+	// and rate is left to live telemetry, which is published while the replay
+	// is ongoing rather than after it.
+	// Maximum messages waiting to be acknowledged by the broker while replaying
+	size_t replay_window{16};
+	// Maximum messages published per second while replaying, including live
+	// telemetry, 0 for no limit
+	double replay_rate{0.0};
+	// Queued payloads are replayed at the QoS level they were sent at.
+	// Consecutive payloads of the same level are merged into array payloads of
+	// up to this many bytes, or max_payload_size if that is smaller.
+	size_t replay_batch_size{64 * 1024};
+
+	// Default QoS of published telemetry and attributes. Telemetry published
+	// at AtMostOnce skips acknowledgement tracking and is dropped rather than
+	// queued while offline.
+	MqttQos telemetry_qos{MqttQos::AtLeastOnce};
+	MqttQos attributes_qos{MqttQos::AtLeastOnce};
+
+	// File to persist the attribute values acknowledged by the broker in, so
+	// that only changed attributes are sent after a restart
+	const char* attribute_state_file{nullptr};
+
+	// Directory to persist telemetry queued while offline in. If not set, the
+	// telemetry is only kept in memory.
+	const char* spool_dir{nullptr};
+	// Size of each spool segment file in bytes
+	size_t spool_segment_size{1024 * 1024};
+	// Maximum number of spool segment files, the oldest is dropped when full
+	size_t spool_max_segments{64};
+};
+
+/**
+ * Policy deciding whether a new telemetry sample is different enough from the
+ * last accepted value to be sent. A value of zero disables a setting.
+ */
+struct TelemetryFilter {
+	// Ignore numeric changes smaller than or equal to this amount
+	double deadband{0.0};
+	// Ignore numeric changes smaller than or equal to this percentage of the
+	// last accepted value
+	double deadband_percent{0.0};
+	// Minimum time between accepted values (ms)
+	int64_t min_interval{0};
+	// Accept a value even if unchanged once this much time has passed since
+	// the last accepted value (ms)
+	int64_t max_silence{0};
+};
+
+/**
+ * Statistics computed over each flush window of a telemetry key.
+ * Each selected statistic is sent as a derived key named after the original
+ * key, for example `temp_min` and `temp_avg`.
+ */
+enum TelemetryAggregation : uint8_t {
+	AggregateNone = 0,
+	AggregateMin = 1 << 0,
+	AggregateMax = 1 << 1,
+	AggregateAvg = 1 << 2,
+	AggregateCount = 1 << 3,
+	AggregateLast = 1 << 4
 };
 
 class Controller {
@@ -25,46 +121,529 @@ class Controller {
 										 const nlohmann::json& params)>
 		RpcHandler;
 
+	/**
+	 * Identifies a registered telemetry key without needing to look it up by
+	 * name.
+	 */
+	typedef TelemetryCache::Handle TelemetryHandle;
+
+	/**
+	 * Identifies a device registered with registerDevice().
+	 */
+	typedef size_t DeviceHandle;
+
 	void connect(const ControllerConfig& config);
 	void disconnect();
 
+	/**
+	 * Sets a telemetry value, timestamped with the current time.
+	 * In batching mode every call is recorded as a separate sample, otherwise
+	 * only the latest value of each key is kept until the next send().
+	 */
 	void publishTelemetry(const char* key, nlohmann::json&& value);
 
+	/**
+	 * Sets a telemetry value measured at an explicit time.
+	 * @param ts The timestamp of the value in milliseconds since the epoch.
+	 */
+	void publishTelemetry(const char* key, nlohmann::json&& value, int64_t ts);
+
+	/**
+	 * Registers a telemetry key so that it can be updated by handle.
+	 * Registering the same key again returns the same handle.
+	 * @return The handle of the key.
+	 */
+	TelemetryHandle registerTelemetryKey(const char* key);
+
+	/**
+	 * Checks if a handle was returned by registerTelemetryKey().
+	 */
+	bool isTelemetryHandle(TelemetryHandle handle) const {
+		return m_telemetry.contains(handle);
+	}
+
+	/**
+	 * Sets the telemetry value of a registered key, timestamped with the
+	 * current time.
+	 */
+	void publishTelemetry(TelemetryHandle handle, nlohmann::json&& value);
+
+	/**
+	 * Sets the telemetry value of a registered key measured at an explicit
+	 * time.
+	 * @param ts The timestamp of the value in milliseconds since the epoch.
+	 */
+	void publishTelemetry(TelemetryHandle handle,
+						  nlohmann::json&& value,
+						  int64_t ts);
+
+	/**
+	 * Sets a numeric telemetry value of a registered key without building a
+	 * JSON value. Keys without a filter or aggregation are compared and stored
+	 * in place, other keys fall back to the JSON path.
+	 * Integral values are sent as integers.
+	 * @param ts The timestamp of the value in milliseconds since the epoch.
+	 */
+	void publishTelemetryNumber(TelemetryHandle handle,
+								double value,
+								int64_t ts);
+
+	/**
+	 * Sets a boolean telemetry value of a registered key without building a
+	 * JSON value, as publishTelemetryNumber() does for numbers.
+	 * @param ts The timestamp of the value in milliseconds since the epoch.
+	 */
+	void publishTelemetryBool(TelemetryHandle handle, bool value, int64_t ts);
+
+	/**
+	 * Sets the filter used to suppress insignificant changes of a telemetry
+	 * key.
+	 */
+	void setTelemetryFilter(const char* key, const TelemetryFilter& filter);
+
+	/**
+	 * Removes the filter of a telemetry key, so that any change is sent.
+	 * @return true if the key had a filter, false otherwise.
+	 */
+	bool clearTelemetryFilter(const char* key);
+
+	/**
+	 * Sets the statistics to send for a telemetry key instead of its samples.
+	 * Numeric values of the key are aggregated until the next send(), which
+	 * sends each statistic as a derived key. Non-numeric values are sent as
+	 * usual.
+	 * @param modes A combination of TelemetryAggregation flags, or
+	 * AggregateNone to stop aggregating the key.
+	 */
+	void setTelemetryAggregation(const char* key, uint8_t modes);
+
+	/**
+	 * Sets the QoS to publish a telemetry key at, overriding the telemetry_qos
+	 * of the config. Keys with different QoS levels are sent in separate
+	 * payloads.
+	 */
+	void setTelemetryQos(const char* key, MqttQos qos);
+
+	/**
+	 * Makes a telemetry key use the telemetry_qos of the config again.
+	 */
+	void clearTelemetryQos(const char* key);
+
 	void setAttribute(const char* key, nlohmann::json&& value);
 
+	/**
+	 * Registers a device to publish data for in gateway mode, announcing it to
+	 * the server. Registering the same device again returns the same handle.
+	 * Gateway devices share the connection of the controller, and the data of
+	 * all devices is sent together on each send(). Devices are announced again
+	 * after reconnecting, paced by the replay rate.
+	 * @param name The name of the device on the server.
+	 * @return The handle of the device.
+	 */
+	DeviceHandle registerDevice(const char* name);
+
+	/**
+	 * Checks if a handle was returned by registerDevice().
+	 */
+	bool isDevice(DeviceHandle device) const {
+		return device < m_devices.size();
+	}
+
+	/**
+	 * Sets a telemetry value of a gateway device.
+	 * Only the latest value of each key is kept until the next send(). Device
+	 * telemetry isn't queued while offline, the latest values are sent once
+	 * connected again instead. Unlike the controller's own telemetry, it is
+	 * also not kept until acknowledged, so values in flight when the
+	 * connection is lost are not sent again.
+	 * @param ts The timestamp of the value in milliseconds since the epoch.
+	 */
+	void publishDeviceTelemetry(DeviceHandle device,
+								const char* key,
+								nlohmann::json&& value,
+								int64_t ts);
+
+	/**
+	 * Sets an attribute of a gateway device.
+	 * Attributes are kept until acknowledged, and after reconnecting only
+	 * those that changed since are sent again.
+	 */
+	void setDeviceAttribute(DeviceHandle device,
+							const char* key,
+							nlohmann::json&& value);
+
 	/**
 	 * Sends any updated telemetry data.
 	 * This function should be called regularly to ensure that telemetry data is
 	 * sent in a timely manner.
+	 * In batching mode all recorded samples are sent as a single array
+	 * payload.
 	 * @return true if telemetry data was sent, false otherwise.
 	 */
 	bool send();
 
-	void loop();
+	/**
+	 * Processes MQTT events, replays queued telemetry as the pacing allows,
+	 * and sends any pending data that is due according to the flush policies.
+	 * @param timeout_ms The maximum time to wait for MQTT events (ms), 0 to
+	 * not wait, or negative for the default of one second.
+	 */
+	void loop(int timeout_ms = -1);
 
 	bool isConnected() const { return m_mqtt_client.is_connected(); }
 
+	/**
+	 * Gets the socket of the MQTT connection, for driving the controller from
+	 * an event loop instead of loop().
+	 * @return The socket, or -1 if there is no connection.
+	 */
+	int socket() const { return m_mqtt_client.socket(); }
+
+	/**
+	 * Checks if there is data waiting to be written to the socket.
+	 */
+	bool wantWrite() const { return m_mqtt_client.want_write(); }
+
+	/**
+	 * Processes incoming MQTT packets. Call when the socket is readable.
+	 */
+	void loopRead() { m_mqtt_client.loop_read(); }
+
+	/**
+	 * Writes pending MQTT packets. Call when the socket is writable.
+	 */
+	void loopWrite() { m_mqtt_client.loop_write(); }
+
+	/**
+	 * Handles keepalives and reconnection, replays queued telemetry and sends
+	 * pending data that is due, as loop() does without waiting on the socket.
+	 * Call at least once a second.
+	 */
+	void loopMisc();
+
+	/**
+	 * Gets how long an event loop driving the controller can sleep before a
+	 * timer, flush or replay is due.
+	 * @return The time to sleep (ms), at most one second for keepalives.
+	 */
+	int nextWakeup() { return nextWakeup(steadyTimestamp()); }
+
+	/**
+	 * Sets a function called when an event loop driving the controller should
+	 * ask nextWakeup() again, as data was queued, a timer added or the
+	 * connection changed outside of the loop.
+	 */
+	void setWakeupListener(std::function<void()> listener) {
+		m_wakeup_listener = std::move(listener);
+	}
+
+	/**
+	 * Gets the store of telemetry waiting to be published.
+	 */
+	const OfflineStore& offlineStore() const { return *m_offline_store; }
+
+	/**
+	 * Calls a function after a delay, and then repeatedly if an interval is
+	 * given. Timers are run from loop(), loopMisc() and run().
+	 * @param delay_ms The time until the first call (ms).
+	 * @param interval_ms The time between calls (ms), or 0 to only call once.
+	 * @return The ID of the timer, for cancelTimer().
+	 */
+	size_t addTimer(int64_t delay_ms,
+					int64_t interval_ms,
+					TimerHeap::Callback callback);
+
+	/**
+	 * Stops a timer from being called again.
+	 * @return true if the timer was active, false otherwise.
+	 */
+	bool cancelTimer(size_t timer_id) { return m_timers.cancel(timer_id); }
+
+	/**
+	 * Processes MQTT events and timers until stop() is called, sleeping in
+	 * poll() until the socket is ready or the next timer or flush is due.
+	 */
+	void run();
+
+	/**
+	 * Makes run() return once the current event has been handled.
+	 */
+	void stop() { m_running = false; }
+
 	size_t addRpcHandler(RpcHandler handler);
 	bool removeRpcHandler(size_t handler_id);
 
+	/**
+	 * Gets the current time in milliseconds since the epoch.
+	 */
+	static int64_t currentTimestamp();
+
    protected:
-	virtual void sendTelemetry(nlohmann::json&& payload);
+	/**
+	 * Queues a serialized telemetry payload in the offline store, and
+	 * publishes it right away if connected. While older entries are being
+	 * replayed, it is only published right away if the part of the replay
+	 * window and rate kept for live telemetry allows, and is otherwise replayed
+	 * with them. The entry is kept until the broker acknowledges it, so it is
+	 * published again after a reconnect, or a restart when spooled to disk.
+	 * Payloads published at AtMostOnce are neither tracked nor queued.
+	 * @param payload The payload, only valid for the duration of the call.
+	 * @param qos The QoS level to publish the payload at.
+	 */
+	virtual void sendTelemetry(std::string_view payload, MqttQos qos);
 	virtual void sendAttributes(nlohmann::json&& payload);
 
    private:
 	MqttClientSingleThread m_mqtt_client;
 
-	std::unordered_map<std::string, nlohmann::json> m_telemetry_data;
-	std::unordered_set<std::string> m_tainted_telemetry_keys;
+	TelemetryCache m_telemetry;
+	// Filters of the registered telemetry keys, indexed by handle
+	std::vector<std::optional<TelemetryFilter>> m_telemetry_filters;
+	// QoS overrides of the registered telemetry keys, indexed by handle
+	std::vector<std::optional<MqttQos>> m_telemetry_qos;
+	MqttQos m_default_telemetry_qos{MqttQos::AtLeastOnce};
+	MqttQos m_attributes_qos{MqttQos::AtLeastOnce};
+
+	struct TelemetryAggregate {
+		uint8_t modes{0};
+		// Handles of the derived keys, indexed by the bit of each mode
+		std::array<TelemetryHandle, 5> derived{};
+
+		// Statistics of the current window
+		size_t count{0};
+		double min{0.0};
+		double max{0.0};
+		double sum{0.0};
+		double last{0.0};
+		int64_t last_ts{0};
+	};
+
+	// Aggregation of the registered telemetry keys, indexed by handle
+	std::vector<std::optional<TelemetryAggregate>> m_telemetry_aggregates;
+	std::vector<TelemetryHandle> m_aggregated_handles;
+
+	// Reused between sends to avoid reallocating
+	TelemetryWriter m_telemetry_writer;
+	std::vector<TelemetryHandle> m_flush_handles;
+
+	// Samples recorded in batching mode, grouped by timestamp (ms)
+	bool m_batch_telemetry{false};
+	std::map<int64_t, std::vector<std::pair<TelemetryHandle, nlohmann::json>>>
+		m_telemetry_samples;
+
+	size_t m_max_payload_size{0};
+
+	// Flush scheduling, times are from steadyTimestamp()
+	int64_t m_flush_interval{0};
+	int64_t m_max_pending_age{0};
+	size_t m_max_pending_count{0};
+	int64_t m_last_flush{0};
+	int64_t m_first_pending{0};	 // 0 if nothing is pending
+	size_t m_sample_count{0};	 // Samples recorded in batching mode
 
 	std::unordered_map<std::string, nlohmann::json> m_attribute_data;
 	std::unordered_set<std::string> m_tainted_attribute_keys;
 
-	std::deque<std::string> m_pending_telemetry;
+	// Attribute values last acknowledged by the broker. Only attributes that
+	// differ from these are sent.
+	std::unordered_map<std::string, nlohmann::json> m_acked_attributes;
+	// Attribute payloads waiting to be acknowledged, by message ID
+	std::unordered_map<int, nlohmann::json> m_attributes_in_flight;
+	std::string m_attribute_state_file;
+
+	// Telemetry waiting to be published while offline
+	std::unique_ptr<OfflineStore> m_offline_store =
+		std::make_unique<MemoryOfflineStore>();
+
+	// Replay pacing, using a token bucket refilled at the replay rate
+	size_t m_replay_window{16};
+	double m_replay_rate{0.0};
+	double m_replay_tokens{0.0};
+	int64_t m_replay_refill_ts{0};
+	size_t m_replay_batch_size{64 * 1024};
+	std::string m_replay_buffer;  // Reused between replayed messages
+
+	// IDs of the offline store entries in each telemetry message that hasn't
+	// been acknowledged yet, by message ID
+	std::unordered_map<int, std::vector<uint64_t>> m_telemetry_in_flight;
+
+	struct GatewayDevice {
+		std::string name;
+		std::string quoted_name;
+		TelemetryCache telemetry;
+		std::unordered_map<std::string, nlohmann::json> attributes;
+		std::unordered_set<std::string> tainted_attributes;
+		// Attribute values last acknowledged by the broker
+		std::unordered_map<std::string, nlohmann::json> acked_attributes;
+	};
+	// Attributes of a device in a gateway attributes payload
+	typedef std::vector<std::pair<DeviceHandle, nlohmann::json>>
+		DeviceAttributes;
+
+	// Devices of gateway mode, indexed by handle
+	std::deque<GatewayDevice> m_devices;
+	std::unordered_map<std::string, DeviceHandle> m_device_index;
+	// Devices with unsent telemetry or attributes, each listed once
+	std::vector<DeviceHandle> m_dirty_devices;
+	std::vector<bool> m_device_dirty;
+	size_t m_device_pending_count{0};  // Unsent device keys
+	std::string m_gateway_buffer;	   // Reused between sends
+	// Devices waiting for a replay token to be announced
+	std::deque<DeviceHandle> m_unannounced_devices;
+	// Gateway attribute payloads waiting to be acknowledged, by message ID
+	std::unordered_map<int, DeviceAttributes> m_device_attributes_in_flight;
+
+	TimerHeap m_timers;
+	bool m_running{false};
+	std::function<void()> m_wakeup_listener;
 
 	std::unordered_map<size_t, RpcHandler> m_rpc_handlers;
 
+	/**
+	 * Gets a monotonic time in milliseconds, used for scheduling.
+	 */
+	static int64_t steadyTimestamp();
+
+	/**
+	 * Records that there is data waiting to be sent.
+	 */
+	void markPending() {
+		if (m_first_pending == 0) {
+			m_first_pending = steadyTimestamp();
+			notifyWakeup();
+		} else if (m_max_pending_count > 0) {
+			notifyWakeup();	 // The count may make a flush due
+		}
+	}
+
+	/**
+	 * Tells the event loop driving the controller that its next wakeup may
+	 * have changed.
+	 */
+	void notifyWakeup() {
+		if (m_wakeup_listener) {
+			m_wakeup_listener();
+		}
+	}
+
+	/**
+	 * Runs due timers, replays queued telemetry and sends pending data that
+	 * is due, after the MQTT events have been processed.
+	 */
+	void processPending();
+
+	/**
+	 * Gets how long run() can sleep before a timer, flush or replay is due.
+	 * @param now The current steadyTimestamp().
+	 * @return The time to sleep (ms), at most one second for keepalives, or 0
+	 * if a flush is already due.
+	 */
+	int nextWakeup(int64_t now);
+
+	/**
+	 * Checks if the flush policies require pending data to be sent now.
+	 */
+	bool isFlushDue() const;
+
+	/**
+	 * Publishes the statistics of the aggregated keys as their derived keys,
+	 * then starts a new window.
+	 */
+	void flushAggregates();
+
+	/**
+	 * Checks if updates of a telemetry key can skip the filters, aggregation
+	 * and batching, only needing to be compared with the stored value.
+	 */
+	bool isPlainTelemetry(TelemetryHandle handle) const {
+		return !m_batch_telemetry && !m_telemetry_filters[handle] &&
+			   !m_telemetry_aggregates[handle];
+	}
+
+	/**
+	 * Gets the QoS level to publish a telemetry key at.
+	 */
+	MqttQos telemetryQos(TelemetryHandle handle) const {
+		const std::optional<MqttQos>& qos = m_telemetry_qos[handle];
+		return qos ? *qos : m_default_telemetry_qos;
+	}
+
+	/**
+	 * Writes a telemetry value to the current payload, first publishing the
+	 * payload if the value would make it exceed the maximum size.
+	 */
+	void writeTelemetry(int64_t ts,
+						TelemetryHandle handle,
+						const nlohmann::json& value,
+						bool array,
+						MqttQos qos);
+
+	bool passesFilter(const TelemetryFilter& filter,
+					  TelemetryHandle handle,
+					  const nlohmann::json& value,
+					  int64_t ts) const;
+
+	/**
+	 * Records that a gateway device has data to send.
+	 */
+	void markDeviceDirty(DeviceHandle device);
+
+	/**
+	 * Announces a gateway device to the server.
+	 * @return false if disconnected.
+	 */
+	bool connectDevice(const GatewayDevice& device);
+
+	/**
+	 * Announces the devices waiting to be, as far as the replay rate allows.
+	 */
+	void announceDevices();
+
+	/**
+	 * Publishes the unsent telemetry and attributes of the gateway devices,
+	 * combining all devices into as few payloads as the maximum payload size
+	 * allows.
+	 * @return true if any data was sent, false otherwise.
+	 */
+	bool sendDeviceData();
+
+	/**
+	 * Publishes queued telemetry, as far as the in-flight window and rate
+	 * allow. Consecutive entries are merged into a single array payload.
+	 */
+	void replayOfflineTelemetry();
+
+	/**
+	 * Adds the replay tokens earned since the last refill.
+	 */
+	void refillReplayTokens();
+
+	/**
+	 * Gets how much of the replay window and rate is kept for live telemetry.
+	 */
+	size_t liveReserve() const {
+		return m_replay_window > 1 ? std::max<size_t>(m_replay_window / 4, 1)
+								   : 0;
+	}
+
+	/**
+	 * Records the attributes of an acknowledged payload, marking any that have
+	 * changed again since as needing to be sent.
+	 */
+	void ackAttributes(const nlohmann::json& attributes);
+
+	/**
+	 * Records the device attributes of an acknowledged gateway payload, as
+	 * ackAttributes() does for the attributes of the controller.
+	 */
+	void ackDeviceAttributes(const DeviceAttributes& attributes);
+
+	void loadAttributeState();
+	void saveAttributeState() const;
+
 	void onMqttConnect(MqttConnectRc rc);
+	void onMqttDisconnect(MqttConnectRc rc);
+	void onMqttPublish(int message_id);
 	void onMqttMessage(int message_id,
 					   const char* topic,
 					   std::string_view payload,
@@ -1,23 +1,83 @@
 #pragma once
 
+#include <cstdint>
 #include <lua.hpp>
+#include "mqtt/mqtt-client.hpp"
 #include "thingsmqtt-config.hpp"
 
+class Controller;
+
 static int lua_thingsmqtt_new(lua_State* L);
 static int lua_thingsmqtt_connect(lua_State* L);
+static int lua_thingsmqtt_key(lua_State* L);
 static int lua_thingsmqtt_telemetry(lua_State* L);
+static int lua_thingsmqtt_telemetry_batch(lua_State* L);
+static int lua_thingsmqtt_set_filter(lua_State* L);
+static int lua_thingsmqtt_set_aggregation(lua_State* L);
+static int lua_thingsmqtt_set_qos(lua_State* L);
 static int lua_thingsmqtt_set_attribute(lua_State* L);
+static int lua_thingsmqtt_set_attributes(lua_State* L);
+static int lua_thingsmqtt_device(lua_State* L);
+static int lua_thingsmqtt_device_telemetry(lua_State* L);
+static int lua_thingsmqtt_device_attributes(lua_State* L);
 static int lua_thingsmqtt_send(lua_State* L);
 static int lua_thingsmqtt_loop(lua_State* L);
+static int lua_thingsmqtt_run(lua_State* L);
+static int lua_thingsmqtt_stop(lua_State* L);
+static int lua_thingsmqtt_every(lua_State* L);
+static int lua_thingsmqtt_after(lua_State* L);
+static int lua_thingsmqtt_cancel(lua_State* L);
+static int lua_thingsmqtt_socket(lua_State* L);
+static int lua_thingsmqtt_want_write(lua_State* L);
+static int lua_thingsmqtt_loop_read(lua_State* L);
+static int lua_thingsmqtt_loop_write(lua_State* L);
+static int lua_thingsmqtt_loop_misc(lua_State* L);
 static int lua_thingsmqtt_is_connected(lua_State* L);
+static int lua_thingsmqtt_offline_queue(lua_State* L);
 static int lua_thingsmqtt_add_rpc_handler(lua_State* L);
 static int lua_thingsmqtt_remove_rpc_handler(lua_State* L);
 
+#ifdef THINGSMQTT_REACTOR
+static int lua_thingsmqtt_reactor(lua_State* L);
+static int lua_reactor_add(lua_State* L);
+static int lua_reactor_remove(lua_State* L);
+static int lua_reactor_poll(lua_State* L);
+static int lua_reactor_gc(lua_State* L);
+#endif
+
 static int lua_thingsmqtt_json_stringify(lua_State* L);
 static int lua_thingsmqtt_json_parse(lua_State* L);
 
 static void lua_push_error_func(lua_State* L);
 
+/**
+ * Publishes the Lua value at an index as the value of a telemetry key.
+ */
+static void lua_publish_telemetry(lua_State* L,
+								  Controller* controller,
+								  size_t handle,
+								  int index,
+								  int64_t ts);
+
+/**
+ * Adds a timer calling the Lua function at index 3 after the delay at index 2,
+ * pushing the ID of the timer.
+ * @param repeat Whether to keep calling the function at that interval.
+ */
+static int lua_add_timer(lua_State* L, bool repeat);
+
+/**
+ * Reads a gateway device from the stack, either as a handle or by name,
+ * registering it if needed.
+ * @return The handle of the device.
+ */
+static size_t lua_check_device(lua_State* L, Controller* controller, int index);
+
+/**
+ * Reads a QoS level from the stack, raising an error if it is out of range.
+ */
+static MqttQos lua_to_qos(lua_State* L, int index);
+
 #ifdef THINGSMQTT_STACK_CHECK
 #define STACK_START(fn_name, nargs)                             \
 	int thingsmqtt_stack_top_##fn_name = lua_gettop(L) - nargs; \
@@ -1,25 +1,65 @@
 #include "lua-thingsmqtt.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include "controller.hpp"
 #include "lauxlib.h"
 #include "lua-thingsmqtt-private.hpp"
 #include "lua-utils.hpp"
+#ifdef THINGSMQTT_REACTOR
+#include "reactor.hpp"
+#endif
 
 static const char* thingsmqtt_meta = "ThingsMqtt";
 
 luaL_Reg library_methods[] = {{"new", lua_thingsmqtt_new},
+#ifdef THINGSMQTT_REACTOR
+							  {"reactor", lua_thingsmqtt_reactor},
+#endif
 							  {"json_stringify", lua_thingsmqtt_json_stringify},
 							  {"json_parse", lua_thingsmqtt_json_parse},
 							  {NULL, NULL}};
 luaL_Reg thingsmqtt_methods[] = {
 	{"connect", lua_thingsmqtt_connect},
+	{"key", lua_thingsmqtt_key},
 	{"telemetry", lua_thingsmqtt_telemetry},
+	{"telemetry_batch", lua_thingsmqtt_telemetry_batch},
+	{"set_filter", lua_thingsmqtt_set_filter},
+	{"set_aggregation", lua_thingsmqtt_set_aggregation},
+	{"set_qos", lua_thingsmqtt_set_qos},
 	{"set_attribute", lua_thingsmqtt_set_attribute},
+	{"set_attributes", lua_thingsmqtt_set_attributes},
+	{"device", lua_thingsmqtt_device},
+	{"device_telemetry", lua_thingsmqtt_device_telemetry},
+	{"device_attributes", lua_thingsmqtt_device_attributes},
 	{"send", lua_thingsmqtt_send},
 	{"loop", lua_thingsmqtt_loop},
+	{"run", lua_thingsmqtt_run},
+	{"stop", lua_thingsmqtt_stop},
+	{"every", lua_thingsmqtt_every},
+	{"after", lua_thingsmqtt_after},
+	{"cancel", lua_thingsmqtt_cancel},
+	{"socket", lua_thingsmqtt_socket},
+	{"want_write", lua_thingsmqtt_want_write},
+	{"loop_read", lua_thingsmqtt_loop_read},
+	{"loop_write", lua_thingsmqtt_loop_write},
+	{"loop_misc", lua_thingsmqtt_loop_misc},
 	{"is_connected", lua_thingsmqtt_is_connected},
+	{"offline_queue", lua_thingsmqtt_offline_queue},
 	{NULL, NULL}};
 
+#ifdef THINGSMQTT_REACTOR
+static const char* reactor_meta = "ThingsMqttReactor";
+
+luaL_Reg reactor_methods[] = {{"add", lua_reactor_add},
+							  {"remove", lua_reactor_remove},
+							  {"poll", lua_reactor_poll},
+							  {"__gc", lua_reactor_gc},
+							  {NULL, NULL}};
+#endif
+
 int luaopen_thingsmqtt(lua_State* L) {
 	STACK_START(luaopen_thingsmqtt, 1);
 
@@ -34,6 +74,16 @@ int luaopen_thingsmqtt(lua_State* L) {
 		lua_pop(L, 1);
 	}
 
+#ifdef THINGSMQTT_REACTOR
+	// Create the reactor metatable
+	if (luaL_newmetatable(L, reactor_meta)) {
+		luaL_register(L, nullptr, reactor_methods);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+#endif
+
 	// Create the ThingsMqtt library
 	lua_newtable(L);
 	luaL_register(L, nullptr, library_methods);
@@ -96,7 +146,83 @@ int lua_thingsmqtt_connect(lua_State* L) {
 	if (auto password = lua_tostring(L, -1)) {
 		config.password = password;
 	}
-	lua_pop(L, 7);
+	lua_getfield(L, 2, "batch_telemetry");
+	if (lua_isboolean(L, -1)) {
+		config.batch_telemetry = lua_toboolean(L, -1);
+	}
+	lua_getfield(L, 2, "max_payload_size");
+	if (lua_isnumber(L, -1)) {
+		config.max_payload_size = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "flush_interval");
+	if (lua_isnumber(L, -1)) {
+		config.flush_interval = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "max_pending_age");
+	if (lua_isnumber(L, -1)) {
+		config.max_pending_age = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "max_pending_count");
+	if (lua_isnumber(L, -1)) {
+		config.max_pending_count = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "offline_max_entries");
+	if (lua_isnumber(L, -1)) {
+		config.offline_max_entries = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "offline_max_bytes");
+	if (lua_isnumber(L, -1)) {
+		config.offline_max_bytes = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "offline_overflow");
+	if (auto overflow = lua_tostring(L, -1)) {
+		if (strcmp(overflow, "drop_oldest") == 0) {
+			config.offline_overflow = OverflowPolicy::DropOldest;
+		} else if (strcmp(overflow, "drop_newest") == 0) {
+			config.offline_overflow = OverflowPolicy::DropNewest;
+		} else if (strcmp(overflow, "decimate") == 0) {
+			config.offline_overflow = OverflowPolicy::Decimate;
+		} else {
+			return luaL_error(L, "invalid offline_overflow '%s'", overflow);
+		}
+	}
+	lua_getfield(L, 2, "replay_window");
+	if (lua_isnumber(L, -1)) {
+		config.replay_window = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "replay_rate");
+	if (lua_isnumber(L, -1)) {
+		config.replay_rate = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, 2, "replay_batch_size");
+	if (lua_isnumber(L, -1)) {
+		config.replay_batch_size = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "telemetry_qos");
+	if (lua_isnumber(L, -1)) {
+		config.telemetry_qos = lua_to_qos(L, -1);
+	}
+	lua_getfield(L, 2, "attributes_qos");
+	if (lua_isnumber(L, -1)) {
+		config.attributes_qos = lua_to_qos(L, -1);
+	}
+	lua_getfield(L, 2, "attribute_state_file");
+	if (auto stateFile = lua_tostring(L, -1)) {
+		config.attribute_state_file = stateFile;
+	}
+	lua_getfield(L, 2, "spool_dir");
+	if (auto spoolDir = lua_tostring(L, -1)) {
+		config.spool_dir = spoolDir;
+	}
+	lua_getfield(L, 2, "spool_segment_size");
+	if (lua_isnumber(L, -1)) {
+		config.spool_segment_size = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 2, "spool_max_segments");
+	if (lua_isnumber(L, -1)) {
+		config.spool_max_segments = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 24);
 
 	// Get SSL config
 	lua_getfield(L, 2, "ssl_config");
@@ -132,8 +258,109 @@ int lua_thingsmqtt_connect(lua_State* L) {
 	return 0;
 }
 
+int lua_thingsmqtt_key(lua_State* L) {
+	STACK_START(lua_thingsmqtt_key, 2);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+
+	// Get key
+	const char* key = luaL_checkstring(L, 2);
+
+	lua_pop(L, 2);
+	lua_pushinteger(L, controller->registerTelemetryKey(key));
+
+	STACK_END(lua_thingsmqtt_key, 1);
+
+	return 1;
+}
+
 int lua_thingsmqtt_telemetry(lua_State* L) {
-	STACK_START(lua_thingsmqtt_telemetry, 3);
+	lua_settop(L, 4);  // Timestamp is optional
+	STACK_START(lua_thingsmqtt_telemetry, 4);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+
+	// Get key, either as a handle from key() or by name
+	Controller::TelemetryHandle handle;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		handle = static_cast<Controller::TelemetryHandle>(lua_tointeger(L, 2));
+		luaL_argcheck(L, controller->isTelemetryHandle(handle), 2,
+					  "invalid telemetry key handle");
+	} else {
+		handle = controller->registerTelemetryKey(luaL_checkstring(L, 2));
+	}
+
+	// Get timestamp
+	int64_t ts = lua_isnil(L, 4)
+					 ? Controller::currentTimestamp()
+					 : static_cast<int64_t>(luaL_checknumber(L, 4));
+
+	lua_publish_telemetry(L, controller, handle, 3, ts);
+
+	lua_pop(L, 4);
+
+	STACK_END(lua_thingsmqtt_telemetry, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_telemetry_batch(lua_State* L) {
+	lua_settop(L, 3);  // Timestamp is optional
+	STACK_START(lua_thingsmqtt_telemetry_batch, 3);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// All values share one timestamp
+	int64_t ts = lua_isnil(L, 3)
+					 ? Controller::currentTimestamp()
+					 : static_cast<int64_t>(luaL_checknumber(L, 3));
+
+	// Check the whole table first, so that a bad entry doesn't leave the
+	// entries before it applied
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 2) != 0) {
+		if (lua_type(L, -2) == LUA_TNUMBER) {
+			if (!controller->isTelemetryHandle(
+					static_cast<Controller::TelemetryHandle>(
+						lua_tointeger(L, -2)))) {
+				return luaL_error(L, "invalid telemetry key handle");
+			}
+		} else if (lua_type(L, -2) != LUA_TSTRING) {
+			return luaL_error(L, "telemetry keys must be names or handles");
+		}
+		if (!lua_can_convert_to_json(L, -1)) {
+			return luaL_error(L, "telemetry value has an invalid table key");
+		}
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 2) != 0) {
+		// Get key, either as a handle from key() or by name. The key is not
+		// converted in place, as that would confuse lua_next().
+		Controller::TelemetryHandle handle =
+			lua_type(L, -2) == LUA_TNUMBER
+				? static_cast<Controller::TelemetryHandle>(lua_tointeger(L, -2))
+				: controller->registerTelemetryKey(lua_tostring(L, -2));
+
+		lua_publish_telemetry(L, controller, handle, lua_gettop(L), ts);
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pop(L, 3);
+
+	STACK_END(lua_thingsmqtt_telemetry_batch, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_set_filter(lua_State* L) {
+	lua_settop(L, 3);  // Filter is optional
+	STACK_START(lua_thingsmqtt_set_filter, 3);
 
 	Controller* controller =
 		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
@@ -141,13 +368,109 @@ int lua_thingsmqtt_telemetry(lua_State* L) {
 	// Get key
 	const char* key = luaL_checkstring(L, 2);
 
-	// Get value
-	nlohmann::json value = lua_value_to_json(L, 3);
-	controller->publishTelemetry(key, std::move(value));
+	// A nil filter removes the filter from the key
+	if (lua_isnil(L, 3)) {
+		controller->clearTelemetryFilter(key);
+		lua_pop(L, 3);
+		STACK_END(lua_thingsmqtt_set_filter, 0);
+		return 0;
+	}
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	// Read filter
+	TelemetryFilter filter;
+	lua_getfield(L, 3, "deadband");
+	if (lua_isnumber(L, -1)) {
+		filter.deadband = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, 3, "deadband_percent");
+	if (lua_isnumber(L, -1)) {
+		filter.deadband_percent = lua_tonumber(L, -1);
+	}
+	lua_getfield(L, 3, "min_interval");
+	if (lua_isnumber(L, -1)) {
+		filter.min_interval = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, 3, "max_silence");
+	if (lua_isnumber(L, -1)) {
+		filter.max_silence = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 4);
+
+	controller->setTelemetryFilter(key, filter);
 
 	lua_pop(L, 3);
 
-	STACK_END(lua_thingsmqtt_telemetry, 0);
+	STACK_END(lua_thingsmqtt_set_filter, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_set_aggregation(lua_State* L) {
+	static const char* const mode_names[] = {"min", "max", "avg", "count",
+											 "last"};
+
+	lua_settop(L, 3);  // Modes are optional
+	STACK_START(lua_thingsmqtt_set_aggregation, 3);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+
+	// Get key
+	const char* key = luaL_checkstring(L, 2);
+
+	// Read modes, nil stops aggregating the key
+	uint8_t modes = AggregateNone;
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		size_t count = lua_objlen(L, 3);
+		for (size_t i = 1; i <= count; ++i) {
+			lua_rawgeti(L, 3, i);
+			const char* name = lua_tostring(L, -1);
+			size_t mode = 0;
+			while (mode < 5 && (name == nullptr ||
+								strcmp(name, mode_names[mode]) != 0)) {
+				++mode;
+			}
+			if (mode == 5) {
+				return luaL_error(L, "invalid aggregation mode '%s'",
+								  name != nullptr ? name : "?");
+			}
+			modes |= 1 << mode;
+			lua_pop(L, 1);
+		}
+	}
+
+	controller->setTelemetryAggregation(key, modes);
+
+	lua_pop(L, 3);
+
+	STACK_END(lua_thingsmqtt_set_aggregation, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_set_qos(lua_State* L) {
+	lua_settop(L, 3);  // QoS is optional
+	STACK_START(lua_thingsmqtt_set_qos, 3);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+
+	// Get key
+	const char* key = luaL_checkstring(L, 2);
+
+	// nil makes the key use the telemetry_qos of the config again
+	if (lua_isnil(L, 3)) {
+		controller->clearTelemetryQos(key);
+	} else {
+		luaL_checktype(L, 3, LUA_TNUMBER);
+		controller->setTelemetryQos(key, lua_to_qos(L, 3));
+	}
+
+	lua_pop(L, 3);
+
+	STACK_END(lua_thingsmqtt_set_qos, 0);
 
 	return 0;
 }
@@ -172,6 +495,116 @@ int lua_thingsmqtt_set_attribute(lua_State* L) {
 	return 0;
 }
 
+int lua_thingsmqtt_set_attributes(lua_State* L) {
+	STACK_START(lua_thingsmqtt_set_attributes, 2);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	// Check the whole table first, so that a bad entry doesn't leave the
+	// entries before it applied
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 2) != 0) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			return luaL_error(L, "attribute keys must be strings");
+		}
+		if (!lua_can_convert_to_json(L, -1)) {
+			return luaL_error(L, "attribute value has an invalid table key");
+		}
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 2) != 0) {
+		controller->setAttribute(lua_tostring(L, -2),
+								 lua_value_to_json(L, lua_gettop(L)));
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pop(L, 2);
+
+	STACK_END(lua_thingsmqtt_set_attributes, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_device(lua_State* L) {
+	STACK_START(lua_thingsmqtt_device, 2);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+
+	// Get device name
+	const char* name = luaL_checkstring(L, 2);
+
+	Controller::DeviceHandle device = controller->registerDevice(name);
+
+	lua_pop(L, 2);
+	lua_pushinteger(L, static_cast<lua_Integer>(device));
+
+	STACK_END(lua_thingsmqtt_device, 1);
+
+	return 1;
+}
+
+int lua_thingsmqtt_device_telemetry(lua_State* L) {
+	lua_settop(L, 4);  // Timestamp is optional
+	STACK_START(lua_thingsmqtt_device_telemetry, 4);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	Controller::DeviceHandle device = lua_check_device(L, controller, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	// All values share one timestamp
+	int64_t ts = lua_isnil(L, 4)
+					 ? Controller::currentTimestamp()
+					 : static_cast<int64_t>(luaL_checknumber(L, 4));
+
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 3) != 0) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			return luaL_error(L, "telemetry keys must be strings");
+		}
+		controller->publishDeviceTelemetry(device, lua_tostring(L, -2),
+										   lua_value_to_json(L, lua_gettop(L)),
+										   ts);
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pop(L, 4);
+
+	STACK_END(lua_thingsmqtt_device_telemetry, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_device_attributes(lua_State* L) {
+	STACK_START(lua_thingsmqtt_device_attributes, 3);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	Controller::DeviceHandle device = lua_check_device(L, controller, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, 3) != 0) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			return luaL_error(L, "attribute keys must be strings");
+		}
+		controller->setDeviceAttribute(device, lua_tostring(L, -2),
+									   lua_value_to_json(L, lua_gettop(L)));
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+
+	lua_pop(L, 3);
+
+	STACK_END(lua_thingsmqtt_device_attributes, 0);
+
+	return 0;
+}
+
 int lua_thingsmqtt_send(lua_State* L) {
 	STACK_START(lua_thingsmqtt_send, 1);
 
@@ -187,19 +620,148 @@ int lua_thingsmqtt_send(lua_State* L) {
 }
 
 int lua_thingsmqtt_loop(lua_State* L) {
-	STACK_START(lua_thingsmqtt_loop, 1);
+	lua_settop(L, 2);  // Timeout is optional
+	STACK_START(lua_thingsmqtt_loop, 2);
 
 	Controller* controller =
 		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
-	lua_pop(L, 1);
+	int timeout_ms =
+		lua_isnil(L, 2) ? -1 : static_cast<int>(luaL_checkinteger(L, 2));
+	lua_pop(L, 2);
 
-	controller->loop();
+	controller->loop(timeout_ms);
 
 	STACK_END(lua_thingsmqtt_loop, 0);
 
 	return 0;
 }
 
+int lua_thingsmqtt_run(lua_State* L) {
+	STACK_START(lua_thingsmqtt_run, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	controller->run();
+
+	STACK_END(lua_thingsmqtt_run, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_stop(lua_State* L) {
+	STACK_START(lua_thingsmqtt_stop, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	controller->stop();
+
+	STACK_END(lua_thingsmqtt_stop, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_every(lua_State* L) {
+	return lua_add_timer(L, true);
+}
+
+int lua_thingsmqtt_after(lua_State* L) {
+	return lua_add_timer(L, false);
+}
+
+int lua_thingsmqtt_cancel(lua_State* L) {
+	STACK_START(lua_thingsmqtt_cancel, 2);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	size_t timer_id = static_cast<size_t>(luaL_checkinteger(L, 2));
+	lua_pop(L, 2);
+
+	lua_pushboolean(L, controller->cancelTimer(timer_id));
+
+	STACK_END(lua_thingsmqtt_cancel, 1);
+
+	return 1;
+}
+
+int lua_thingsmqtt_socket(lua_State* L) {
+	STACK_START(lua_thingsmqtt_socket, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	int fd = controller->socket();
+	if (fd >= 0) {
+		lua_pushinteger(L, fd);
+	} else {
+		lua_pushnil(L);
+	}
+
+	STACK_END(lua_thingsmqtt_socket, 1);
+
+	return 1;
+}
+
+int lua_thingsmqtt_want_write(lua_State* L) {
+	STACK_START(lua_thingsmqtt_want_write, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, controller->wantWrite());
+
+	STACK_END(lua_thingsmqtt_want_write, 1);
+
+	return 1;
+}
+
+int lua_thingsmqtt_loop_read(lua_State* L) {
+	STACK_START(lua_thingsmqtt_loop_read, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	controller->loopRead();
+
+	STACK_END(lua_thingsmqtt_loop_read, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_loop_write(lua_State* L) {
+	STACK_START(lua_thingsmqtt_loop_write, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	controller->loopWrite();
+
+	STACK_END(lua_thingsmqtt_loop_write, 0);
+
+	return 0;
+}
+
+int lua_thingsmqtt_loop_misc(lua_State* L) {
+	STACK_START(lua_thingsmqtt_loop_misc, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	controller->loopMisc();
+
+	STACK_END(lua_thingsmqtt_loop_misc, 0);
+
+	return 0;
+}
+
 int lua_thingsmqtt_is_connected(lua_State* L) {
 	STACK_START(lua_thingsmqtt_is_connected, 1);
 
@@ -214,6 +776,27 @@ int lua_thingsmqtt_is_connected(lua_State* L) {
 	return 1;
 }
 
+int lua_thingsmqtt_offline_queue(lua_State* L) {
+	STACK_START(lua_thingsmqtt_offline_queue, 1);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	lua_pop(L, 1);
+
+	const OfflineStore& store = controller->offlineStore();
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, store.size());
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, store.bytes());
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, store.dropped());
+	lua_setfield(L, -2, "dropped");
+
+	STACK_END(lua_thingsmqtt_offline_queue, 1);
+
+	return 1;
+}
+
 int lua_thingsmqtt_add_rpc_handler(lua_State* L) {
 	STACK_START(lua_thingsmqtt_add_rpc_handler, 1);
 
@@ -312,6 +895,93 @@ int lua_thingsmqtt_json_parse(lua_State* L) {
 	return 1;
 }
 
+#ifdef THINGSMQTT_REACTOR
+int lua_thingsmqtt_reactor(lua_State* L) {
+	STACK_START(lua_thingsmqtt_reactor, 0);
+
+	// Create a new Reactor
+	void* ud = lua_newuserdata(L, sizeof(Reactor*));
+	Reactor** reactor = static_cast<Reactor**>(ud);
+
+	*reactor = new Reactor();
+
+	luaL_getmetatable(L, reactor_meta);
+	lua_setmetatable(L, -2);
+
+	STACK_END(lua_thingsmqtt_reactor, 1);
+
+	return 1;
+}
+
+int lua_reactor_add(lua_State* L) {
+	STACK_START(lua_reactor_add, 2);
+
+	Reactor* reactor =
+		*static_cast<Reactor**>(luaL_checkudata(L, 1, reactor_meta));
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 2, thingsmqtt_meta));
+
+	reactor->add(controller);
+
+	lua_pop(L, 2);
+
+	STACK_END(lua_reactor_add, 0);
+
+	return 0;
+}
+
+int lua_reactor_remove(lua_State* L) {
+	STACK_START(lua_reactor_remove, 2);
+
+	Reactor* reactor =
+		*static_cast<Reactor**>(luaL_checkudata(L, 1, reactor_meta));
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 2, thingsmqtt_meta));
+
+	bool removed = reactor->remove(controller);
+
+	lua_pop(L, 2);
+	lua_pushboolean(L, removed);
+
+	STACK_END(lua_reactor_remove, 1);
+
+	return 1;
+}
+
+int lua_reactor_poll(lua_State* L) {
+	lua_settop(L, 2);  // Timeout is optional
+	STACK_START(lua_reactor_poll, 2);
+
+	Reactor* reactor =
+		*static_cast<Reactor**>(luaL_checkudata(L, 1, reactor_meta));
+	int timeout_ms =
+		lua_isnil(L, 2) ? -1 : static_cast<int>(luaL_checkinteger(L, 2));
+
+	lua_pop(L, 2);
+
+	size_t ready = reactor->poll(timeout_ms);
+	lua_pushinteger(L, static_cast<lua_Integer>(ready));
+
+	STACK_END(lua_reactor_poll, 1);
+
+	return 1;
+}
+
+int lua_reactor_gc(lua_State* L) {
+	STACK_START(lua_reactor_gc, 1);
+
+	Reactor** reactor = static_cast<Reactor**>(lua_touserdata(L, 1));
+	delete *reactor;
+	*reactor = nullptr;
+
+	lua_pop(L, 1);
+
+	STACK_END(lua_reactor_gc, 0);
+
+	return 0;
+}
+#endif
+
 void lua_push_error_func(lua_State* L) {
 	STACK_START(lua_push_error_func, 0);
 
@@ -322,3 +992,89 @@ void lua_push_error_func(lua_State* L) {
 
 	STACK_END(lua_push_error_func, 1);
 }
+
+int lua_add_timer(lua_State* L, bool repeat) {
+	lua_settop(L, 3);
+	STACK_START(lua_add_timer, 3);
+
+	Controller* controller =
+		*static_cast<Controller**>(luaL_checkudata(L, 1, thingsmqtt_meta));
+	int64_t ms = static_cast<int64_t>(luaL_checknumber(L, 2));
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	// Keep the function referenced for as long as the timer exists
+	lua_pushvalue(L, 3);
+	std::shared_ptr<int> func_ref(new int(luaL_ref(L, LUA_REGISTRYINDEX)),
+								  [L](int* ref) {
+									  luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+									  delete ref;
+								  });
+	lua_pop(L, 3);
+
+	auto callback = [L, func_ref]() {
+		lua_push_error_func(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, *func_ref);
+
+		// STACK: traceback, function
+
+		// Errors can't be raised through the controller, so report them and
+		// keep running
+		if (lua_pcall(L, 0, 0, -2) != 0) {
+			fprintf(stderr, "Error in timer callback: %s\n",
+					lua_tostring(L, -1));
+			lua_pop(L, 1);	// Pop the error
+		}
+		lua_pop(L, 1);	// Pop the traceback
+	};
+
+	size_t timer_id =
+		controller->addTimer(ms, repeat ? std::max<int64_t>(ms, 1) : 0,
+							 std::move(callback));
+	lua_pushinteger(L, static_cast<lua_Integer>(timer_id));
+
+	STACK_END(lua_add_timer, 1);
+
+	return 1;
+}
+
+void lua_publish_telemetry(lua_State* L,
+						   Controller* controller,
+						   Controller::TelemetryHandle handle,
+						   int index,
+						   int64_t ts) {
+	// Numbers and booleans skip the conversion to JSON
+	switch (lua_type(L, index)) {
+		case LUA_TNUMBER:
+			controller->publishTelemetryNumber(handle, lua_tonumber(L, index),
+											   ts);
+			break;
+		case LUA_TBOOLEAN:
+			controller->publishTelemetryBool(handle, lua_toboolean(L, index),
+											 ts);
+			break;
+		default:
+			controller->publishTelemetry(handle, lua_value_to_json(L, index),
+										 ts);
+			break;
+	}
+}
+
+size_t lua_check_device(lua_State* L, Controller* controller, int index) {
+	// Either a handle from device() or a name
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		auto device =
+			static_cast<Controller::DeviceHandle>(lua_tointeger(L, index));
+		luaL_argcheck(L, controller->isDevice(device), index,
+					  "invalid device handle");
+		return device;
+	}
+	return controller->registerDevice(luaL_checkstring(L, index));
+}
+
+MqttQos lua_to_qos(lua_State* L, int index) {
+	lua_Integer qos = lua_tointeger(L, index);
+	if (qos < 0 || qos > 2) {
+		luaL_error(L, "invalid QoS level %d", static_cast<int>(qos));
+	}
+	return static_cast<MqttQos>(qos);
+}
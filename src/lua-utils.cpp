@@ -56,6 +56,33 @@ nlohmann::json lua_value_to_json(lua_State* L, int index) {
 	}
 }
 
+bool lua_can_convert_to_json(lua_State* L, int index) {
+	if (lua_type(L, index) != LUA_TTABLE) {
+		return true;
+	}
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+
+	// Tables are objects unless index 1 exists, as in lua_value_to_json()
+	lua_pushinteger(L, 1);
+	lua_gettable(L, index);
+	bool object = lua_isnil(L, -1);
+	lua_pop(L, 1);
+
+	lua_pushnil(L);	 // First key
+	while (lua_next(L, index) != 0) {
+		int key_type = lua_type(L, -2);
+		if ((object && key_type != LUA_TSTRING && key_type != LUA_TNUMBER) ||
+			!lua_can_convert_to_json(L, -1)) {
+			lua_pop(L, 2);	// Pop key and value
+			return false;
+		}
+		lua_pop(L, 1);	// Pop value, keep key for next iteration
+	}
+	return true;
+}
+
 void lua_json_to_value(lua_State* L, const nlohmann::json& json) {
 	switch (json.type()) {
 		case nlohmann::json::value_t::null:
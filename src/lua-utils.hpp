@@ -10,6 +10,15 @@
  */
 nlohmann::json lua_value_to_json(lua_State* L, int index);
 
+/**
+ * Checks if a Lua value can be converted to JSON without raising an error,
+ * which is the case unless an object table has keys that aren't strings or
+ * numbers.
+ * @param L The Lua state.
+ * @param index The index of the Lua value to check.
+ */
+bool lua_can_convert_to_json(lua_State* L, int index);
+
 /**
  * Converts a JSON value to a Lua value.
  * Pushes the resulting value onto the Lua stack.
@@ -1,4 +1,6 @@
 #include "mqtt-client-singlethread.hpp"
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
 
 MqttClientSingleThread::~MqttClientSingleThread() {
@@ -7,12 +9,52 @@ MqttClientSingleThread::~MqttClientSingleThread() {
 	}
 }
 
-void MqttClientSingleThread::loop() {
+void MqttClientSingleThread::loop(int timeout_ms) {
 	if (m_mosq == nullptr) {
 		throw std::runtime_error("MQTT client is not initialized");
 	}
 
-	int rc = mosquitto_loop(m_mosq, -1, 1);
+	int rc = mosquitto_loop(m_mosq, timeout_ms, 1);
+	check_loop_rc(rc);
+}
+
+void MqttClientSingleThread::loop_read() {
+	if (m_mosq == nullptr) {
+		throw std::runtime_error("MQTT client is not initialized");
+	}
+
+	check_loop_rc(mosquitto_loop_read(m_mosq, 1));
+}
+
+void MqttClientSingleThread::loop_write() {
+	if (m_mosq == nullptr) {
+		throw std::runtime_error("MQTT client is not initialized");
+	}
+
+	check_loop_rc(mosquitto_loop_write(m_mosq, 1));
+}
+
+void MqttClientSingleThread::loop_misc() {
+	if (m_mosq == nullptr) {
+		throw std::runtime_error("MQTT client is not initialized");
+	}
+
+	if (mosquitto_socket(m_mosq) >= 0) {
+		check_loop_rc(mosquitto_loop_misc(m_mosq));
+		return;
+	}
+
+	// Start reconnecting without blocking, backing off after each failure
+	int64_t now = steady_ms();
+	if (m_reconnect && now >= m_reconnect_at) {
+		if (mosquitto_reconnect_async(m_mosq) != MOSQ_ERR_SUCCESS) {
+			m_reconnect_delay = std::min<int64_t>(m_reconnect_delay * 2, 30000);
+		}
+		m_reconnect_at = now + m_reconnect_delay;
+	}
+}
+
+void MqttClientSingleThread::check_loop_rc(int rc) {
 	if (rc == MOSQ_ERR_CONN_LOST || rc == MOSQ_ERR_NO_CONN) {
 		m_connected = false;
 		return;
@@ -22,6 +64,12 @@ void MqttClientSingleThread::loop() {
 	}
 }
 
+int64_t MqttClientSingleThread::steady_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
 int MqttClientSingleThread::lib_init() {
 	return mosquitto_lib_init();
 }
@@ -52,6 +100,9 @@ void MqttClientSingleThread::on_connect(struct mosquitto* mosq,
 
 	client->m_connected =
 		static_cast<MqttConnectRc>(rc) == MqttConnectRc::Accepted;
+	if (client->m_connected) {
+		client->m_reconnect_delay = 1000;
+	}
 
 	if (client->m_connect_callback) {
 		client->m_connect_callback(static_cast<MqttConnectRc>(rc));
@@ -65,6 +116,10 @@ void MqttClientSingleThread::on_disconnect(struct mosquitto* mosq,
 
 	client->m_connected = false;
 
+	// Only reconnect if the connection was lost rather than closed
+	client->m_reconnect = rc != 0;
+	client->m_reconnect_at = steady_ms() + client->m_reconnect_delay;
+
 	if (client->m_disconnect_callback) {
 		client->m_disconnect_callback(static_cast<MqttConnectRc>(rc));
 	}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include "mqtt-client.hpp"
 
 /**
@@ -9,10 +10,51 @@ class MqttClientSingleThread : public MqttClient {
    public:
 	~MqttClientSingleThread() override;
 
-	void loop() override;
+	void loop() override { loop(-1); }
+
+	/**
+	 * Process network traffic, waiting for it for up to a timeout.
+	 * @param timeout_ms The maximum time to wait (ms), 0 to return
+	 * immediately, or negative for the default of one second.
+	 */
+	void loop(int timeout_ms);
 
 	bool is_connected() const override { return m_connected; }
 
+	/**
+	 * Get the socket of the connection, for polling in an external event loop.
+	 * @return The socket, or -1 if there is no connection.
+	 * @note The socket changes when the client reconnects.
+	 */
+	int socket() const {
+		return m_mosq != nullptr ? mosquitto_socket(m_mosq) : -1;
+	}
+
+	/**
+	 * Check if there is data waiting to be written to the socket.
+	 */
+	bool want_write() const {
+		return m_mosq != nullptr && mosquitto_want_write(m_mosq);
+	}
+
+	/**
+	 * Read incoming packets. Call when the socket is readable.
+	 */
+	void loop_read();
+
+	/**
+	 * Write pending packets. Call when the socket is writable and want_write()
+	 * is true.
+	 */
+	void loop_write();
+
+	/**
+	 * Send keepalive pings, retry messages and reconnect after the connection
+	 * is lost. Call at least once a second when using loop_read() and
+	 * loop_write() instead of loop().
+	 */
+	void loop_misc();
+
    private:
 	int lib_init() override;
 	void after_configure() override;
@@ -34,5 +76,19 @@ class MqttClientSingleThread : public MqttClient {
 					   int level,
 					   const char* msg);
 
+	/**
+	 * Handle the result of a loop function.
+	 * @throws std::runtime_error on errors other than the connection being
+	 * lost.
+	 */
+	void check_loop_rc(int rc);
+
+	static int64_t steady_ms();
+
 	bool m_connected{false};
+
+	// Reconnection when driven by loop_misc(), with an exponential backoff
+	bool m_reconnect{false};
+	int64_t m_reconnect_at{0};
+	int64_t m_reconnect_delay{1000};
 };
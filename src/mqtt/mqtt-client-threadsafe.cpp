@@ -1,5 +1,6 @@
 #include "mqtt-client-threadsafe.hpp"
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 
 MqttClientThreadSafe::~MqttClientThreadSafe() {
@@ -10,48 +11,94 @@ MqttClientThreadSafe::~MqttClientThreadSafe() {
 }
 
 void MqttClientThreadSafe::loop() {
-	MqttEvent event;
-	while (auto event = m_event_queue.pop()) {
-		switch (event->type) {
-			case MqttEventType::Connect:
-				if (m_connect_callback) {
-					m_connect_callback(static_cast<MqttConnectRc>(event->rc));
-				}
-				break;
-			case MqttEventType::Disconnect:
-				if (m_disconnect_callback) {
-					m_disconnect_callback(event->rc);
-				}
-				break;
-			case MqttEventType::Publish:
-				if (m_publish_callback) {
-					m_publish_callback(event->message_id);
-				}
-				break;
-			case MqttEventType::Message:
-				if (m_message_callback) {
-					m_message_callback(event->message_id, event->topic.c_str(),
-									   std::string_view(event->payload),
-									   event->qos, event->retain);
-				}
-				break;
-			case MqttEventType::Subscribe:
-				if (m_subscribe_callback) {
-					m_subscribe_callback(event->message_id);
-				}
-				break;
-			case MqttEventType::Unsubscribe:
-				if (m_unsubscribe_callback) {
-					m_unsubscribe_callback(event->message_id);
-				}
-				break;
-			default:
-				// Unknown event type, should not happen
-				break;
+	// Take all pending events at once, after any left by a callback that
+	// threw. The buffer is swapped out while the events are handled, so that
+	// a callback calling loop() again can't handle them twice.
+	std::vector<MqttEvent> events;
+	events.swap(m_events);
+	m_event_queue.drain(events);
+
+	size_t next = 0;
+	try {
+		while (next < events.size()) {
+			handle_event(events[next++]);
 		}
+	} catch (...) {
+		// Keep the events after the one that threw for the next loop(), ahead
+		// of any queued since
+		m_events.insert(m_events.begin(),
+						std::make_move_iterator(events.begin() + next),
+						std::make_move_iterator(events.end()));
+		throw;
+	}
+
+	// Give the buffers back to the network thread for the next messages
+	for (MqttEvent& event : events) {
+		if (event.type == MqttEventType::Message) {
+			recycle_buffer(std::move(event.topic));
+			recycle_buffer(std::move(event.payload));
+		}
+	}
+	events.clear();
+	if (m_events.empty()) {
+		m_events.swap(events);
 	}
 }
 
+void MqttClientThreadSafe::handle_event(MqttEvent& event) {
+	switch (event.type) {
+		case MqttEventType::Connect:
+			if (m_connect_callback) {
+				m_connect_callback(static_cast<MqttConnectRc>(event.rc));
+			}
+			break;
+		case MqttEventType::Disconnect:
+			if (m_disconnect_callback) {
+				m_disconnect_callback(event.rc);
+			}
+			break;
+		case MqttEventType::Publish:
+			if (m_publish_callback) {
+				m_publish_callback(event.message_id);
+			}
+			break;
+		case MqttEventType::Message:
+			if (m_message_callback) {
+				m_message_callback(event.message_id, event.topic.c_str(),
+								   std::string_view(event.payload),
+								   event.qos, event.retain);
+			}
+			break;
+		case MqttEventType::Subscribe:
+			if (m_subscribe_callback) {
+				m_subscribe_callback(event.message_id);
+			}
+			break;
+		case MqttEventType::Unsubscribe:
+			if (m_unsubscribe_callback) {
+				m_unsubscribe_callback(event.message_id);
+			}
+			break;
+		default:
+			// Unknown event type, should not happen
+			break;
+	}
+}
+
+std::string MqttClientThreadSafe::take_buffer() {
+	if (auto buffer = m_buffer_pool.pop()) {
+		return std::move(*buffer);
+	}
+	return std::string();
+}
+
+void MqttClientThreadSafe::recycle_buffer(std::string&& buffer) {
+	if (buffer.capacity() == 0 || buffer.capacity() > MAX_RECYCLED_BUFFER) {
+		return;
+	}
+	m_buffer_pool.try_emplace(std::move(buffer));
+}
+
 int MqttClientThreadSafe::lib_init() {
 	std::lock_guard<std::mutex> lock(m_lib_init_mutex);
 	return mosquitto_lib_init();
@@ -124,10 +171,18 @@ void MqttClientThreadSafe::on_message(struct mosquitto* mosq,
 									  void* obj,
 									  const struct mosquitto_message* message) {
 	auto* client = static_cast<MqttClientThreadSafe*>(obj);
+
+	// Copy into recycled buffers, which already have the capacity needed
+	// once messages have been received for a while
+	std::string topic = client->take_buffer();
+	topic.assign(message->topic);
+	std::string payload = client->take_buffer();
+	payload.assign(static_cast<const char*>(message->payload),
+				   message->payloadlen);
+
 	client->m_event_queue.emplace(MqttEvent{
-		.topic = message->topic,
-		.payload = std::string(static_cast<const char*>(message->payload),
-							   message->payloadlen),
+		.topic = std::move(topic),
+		.payload = std::move(payload),
 		.message_id = message->mid,
 		.type = MqttEventType::Message,
 		.qos = static_cast<MqttQos>(message->qos),
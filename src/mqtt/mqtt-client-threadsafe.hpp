@@ -2,7 +2,7 @@
 
 #include <atomic>
 #include "mqtt-client.hpp"
-#include "threadsafe-queue.hpp"
+#include "spsc-queue.hpp"
 
 class MqttClientThreadSafe : public MqttClient {
    private:
@@ -38,6 +38,11 @@ class MqttClientThreadSafe : public MqttClient {
 	int lib_init() override;
 	void after_configure() override;
 
+	/**
+	 * Call the callback for an event. Called from loop().
+	 */
+	void handle_event(MqttEvent& event);
+
 	static void on_connect(struct mosquitto* mosq, void* obj, int rc);
 	static void on_disconnect(struct mosquitto* mosq, void* obj, int rc);
 	static void on_publish(struct mosquitto* mosq, void* obj, int message_id);
@@ -60,5 +65,33 @@ class MqttClientThreadSafe : public MqttClient {
 	std::atomic<bool> m_connected{false};
 
 	std::mutex m_lib_init_mutex;
-	ThreadSafeQueue<MqttEvent> m_event_queue;
+
+	// Events from the network thread to the thread calling loop()
+	SpscQueue<MqttEvent> m_event_queue;
+	// Events left by a callback that threw, to be handled by the next loop(),
+	// otherwise a buffer reused to avoid reallocating
+	std::vector<MqttEvent> m_events;
+
+	/**
+	 * Take a string buffer for an event from the pool, or a new one if the pool
+	 * is empty. Called from the network thread.
+	 */
+	std::string take_buffer();
+
+	/**
+	 * Hand the buffer of a handled event back to the network thread, or free
+	 * it if it is too large or the pool is full. Called from the loop() thread.
+	 */
+	void recycle_buffer(std::string&& buffer);
+
+	// Largest buffer kept for reuse, so a single large message doesn't hold on
+	// to its memory
+	static const size_t MAX_RECYCLED_BUFFER = 64 * 1024;
+
+	// Topic and payload buffers of handled events, returned from the loop()
+	// thread to the network thread. Reusing them means that receiving messages
+	// doesn't allocate once the buffers have grown. Buffers larger than
+	// MAX_RECYCLED_BUFFER, and any that don't fit while the pool is full, are
+	// still freed on the loop() thread.
+	SpscQueue<std::string> m_buffer_pool{256};
 };
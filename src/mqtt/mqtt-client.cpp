@@ -1,4 +1,5 @@
 #include "mqtt-client.hpp"
+#include <algorithm>
 #include <stdexcept>
 
 MqttClient::~MqttClient() {
@@ -81,13 +82,25 @@ void MqttClient::disconnect() {
 }
 
 void MqttClient::subscribe(const char* topic, MqttQos qos) {
+	// Already subscribed, and resubscribed on reconnection
+	auto& subscriptions = m_qos_subscriptions[static_cast<int>(qos)];
+	if (std::find(subscriptions.begin(), subscriptions.end(), topic) !=
+		subscriptions.end()) {
+		return;
+	}
+
 	int rc = mosquitto_subscribe(m_mosq, nullptr, topic, static_cast<int>(qos));
 	if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN) {
 		throw std::runtime_error("Failed to subscribe to topic");
 	}
 
-	// Record the subscription for (re)applying on reconnection
-	m_qos_subscriptions[static_cast<int>(qos)].emplace_back(topic);
+	// Record the subscription for (re)applying on reconnection, replacing any
+	// earlier one with a different QoS
+	for (auto& qos_list : m_qos_subscriptions) {
+		qos_list.erase(std::remove(qos_list.begin(), qos_list.end(), topic),
+					   qos_list.end());
+	}
+	subscriptions.emplace_back(topic);
 }
 
 void MqttClient::unsubscribe(const char* topic) {
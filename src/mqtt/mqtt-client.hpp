@@ -141,7 +141,8 @@ class MqttClient {
 	/**
 	 * Subscribe to a topic.
 	 * @note If the client is not currently connected, the subscription will be
-	 * applied when the client connects.
+	 * applied when the client connects. Subscribing again to a topic with the
+	 * same QoS does nothing.
 	 * @param topic The topic to subscribe to.
 	 * @param qos The Quality of Service level. Default is AtLeastOnce.
 	 */
@@ -0,0 +1,159 @@
+#include "offline-store.hpp"
+#include <algorithm>
+
+std::optional<uint64_t> MemoryOfflineStore::push(std::string_view payload,
+												 uint8_t qos) {
+	if (m_max_bytes != 0 && payload.size() > m_max_bytes) {
+		++m_dropped;  // Can never fit
+		return std::nullopt;
+	}
+
+	// Start a new sequence once everything was published
+	if (m_read == m_entries.size()) {
+		m_next_seq = 0;
+		m_stride = 1;
+	}
+	uint64_t seq = m_next_seq++;
+
+	// While decimating, new entries are thinned out like the older ones
+	if (m_policy == OverflowPolicy::Decimate && seq % m_stride != 0) {
+		++m_dropped;
+		return std::nullopt;
+	}
+
+	// Make room for the new entry
+	while (!fits(payload.size())) {
+		if (m_policy == OverflowPolicy::DropNewest) {
+			++m_dropped;
+			return std::nullopt;
+		}
+		if (m_policy == OverflowPolicy::Decimate && decimate()) {
+			continue;
+		}
+		dropOldest();
+	}
+
+	uint64_t id = m_next_id++;
+	m_entries.push_back(
+		Entry{std::string(payload), id, seq, qos, false, false});
+	++m_count;
+	m_bytes += payload.size();
+	return id;
+}
+
+uint64_t MemoryOfflineStore::advance() {
+	Entry& entry = m_entries[m_read];
+	entry.published = true;
+	skipPublished();
+	return entry.id;
+}
+
+void MemoryOfflineStore::markPublished(uint64_t id) {
+	size_t index = find(id);
+	if (index == m_entries.size()) {
+		return;
+	}
+
+	m_entries[index].published = true;
+	if (index == m_read) {
+		skipPublished();
+	}
+}
+
+void MemoryOfflineStore::ack(uint64_t id) {
+	size_t index = find(id);
+	if (index == m_entries.size()) {
+		return;	 // Dropped
+	}
+
+	Entry& entry = m_entries[index];
+	if (!entry.published || entry.acked) {
+		return;
+	}
+	entry.acked = true;
+	--m_count;
+	m_bytes -= entry.payload.size();
+	std::string().swap(entry.payload);
+
+	if (index == 0) {
+		popFront();
+	}
+}
+
+void MemoryOfflineStore::rewind() {
+	for (Entry& entry : m_entries) {
+		entry.published = entry.acked;
+	}
+	m_read = 0;
+	skipPublished();
+}
+
+size_t MemoryOfflineStore::find(uint64_t id) const {
+	auto it = std::lower_bound(
+		m_entries.begin(), m_entries.end(), id,
+		[](const Entry& entry, uint64_t id) { return entry.id < id; });
+	if (it == m_entries.end() || it->id != id) {
+		return m_entries.size();
+	}
+	return static_cast<size_t>(it - m_entries.begin());
+}
+
+void MemoryOfflineStore::skipPublished() {
+	while (m_read < m_entries.size() && m_entries[m_read].published) {
+		++m_read;
+	}
+}
+
+void MemoryOfflineStore::popFront() {
+	do {
+		m_entries.pop_front();
+		if (m_read > 0) {
+			--m_read;
+		}
+	} while (!m_entries.empty() && m_entries.front().acked);
+	skipPublished();
+}
+
+void MemoryOfflineStore::dropOldest() {
+	// The front entry is never acked, and if it was published its ack is
+	// ignored once it arrives
+	--m_count;
+	m_bytes -= m_entries.front().payload.size();
+	++m_dropped;
+	popFront();
+}
+
+bool MemoryOfflineStore::decimate() {
+	size_t unpublished = 0;
+	for (size_t i = m_read; i < m_entries.size(); ++i) {
+		unpublished += !m_entries[i].published;
+	}
+	if (unpublished < 2) {
+		return false;
+	}
+
+	// Keep the published entries, and the unpublished entries on the doubled
+	// stride
+	m_stride *= 2;
+	std::deque<Entry> kept;
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		Entry& entry = m_entries[i];
+		if (!entry.published && entry.seq % m_stride != 0) {
+			--m_count;
+			m_bytes -= entry.payload.size();
+			++m_dropped;
+		} else {
+			kept.push_back(std::move(entry));
+		}
+	}
+	m_entries = std::move(kept);
+
+	// The entries before the read cursor were all published and kept, so it
+	// only has to skip any published entries that are now under it. If the
+	// front entry was dropped, acked entries may now be at the front.
+	skipPublished();
+	if (!m_entries.empty() && m_entries.front().acked) {
+		popFront();
+	}
+	return true;
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * Holds telemetry payloads until the broker acknowledges them.
+ * Entries are kept in order, each with an ID that increases with every push.
+ * A read cursor walks the entries that haven't been published yet, though an
+ * entry can also be published ahead of it, as live telemetry is while a
+ * backlog is replayed. Entries are acked by ID in any order, and are only
+ * discarded once acked. rewind() marks every unacked entry as unpublished, so
+ * unconfirmed entries are published again.
+ */
+class OfflineStore {
+   public:
+	virtual ~OfflineStore() = default;
+
+	/**
+	 * Appends a payload to the store.
+	 * @param qos The MQTT QoS level to publish the payload at.
+	 * @return The ID of the entry, or nothing if the store's limits dropped it.
+	 */
+	virtual std::optional<uint64_t> push(std::string_view payload,
+										 uint8_t qos) = 0;
+
+	/**
+	 * Checks if there are entries that have not been published yet.
+	 */
+	virtual bool hasPending() const = 0;
+
+	/**
+	 * Gets the next entry to publish.
+	 * @return The payload, valid until entries are next pushed or acked.
+	 */
+	virtual std::string_view peek() const = 0;
+
+	/**
+	 * Gets the QoS level of the entry returned by peek().
+	 */
+	virtual uint8_t peekQos() const = 0;
+
+	/**
+	 * Marks the entry returned by peek() as published.
+	 * @return The ID of the entry.
+	 */
+	virtual uint64_t advance() = 0;
+
+	/**
+	 * Marks an entry as published ahead of the read cursor, which skips it.
+	 */
+	virtual void markPublished(uint64_t id) = 0;
+
+	/**
+	 * Discards a published entry. Acks of unpublished entries and of entries
+	 * that were dropped are ignored.
+	 */
+	virtual void ack(uint64_t id) = 0;
+
+	/**
+	 * Marks all unacked entries as unpublished, so they are published again.
+	 * Acks for entries published before the rewind are no longer expected.
+	 */
+	virtual void rewind() = 0;
+
+	/**
+	 * Gets the number of unacked entries, including published ones.
+	 */
+	virtual size_t size() const = 0;
+
+	/**
+	 * Gets the total size of the unacked entries' payloads in bytes.
+	 */
+	virtual size_t bytes() const = 0;
+
+	/**
+	 * Gets the number of entries discarded to stay within the store's limits.
+	 */
+	virtual size_t dropped() const = 0;
+
+	bool empty() const { return size() == 0; }
+};
+
+/**
+ * What to do when an entry doesn't fit in a bounded offline store.
+ */
+enum class OverflowPolicy : uint8_t {
+	DropOldest,	 // Discard the oldest entries
+	DropNewest,	 // Discard the new entry
+	Decimate	 // Keep evenly spaced entries, halving their rate each time
+};
+
+/**
+ * Offline store kept in memory, optionally bounded by a number of entries and
+ * a total payload size.
+ */
+class MemoryOfflineStore final : public OfflineStore {
+   public:
+	/**
+	 * @param max_entries The maximum number of entries, 0 for no limit.
+	 * @param max_bytes The maximum total payload size, 0 for no limit.
+	 * @param policy What to do when a new entry exceeds a limit.
+	 */
+	explicit MemoryOfflineStore(size_t max_entries = 0,
+								size_t max_bytes = 0,
+								OverflowPolicy policy = OverflowPolicy::DropOldest)
+		: m_max_entries(max_entries), m_max_bytes(max_bytes), m_policy(policy) {}
+
+	std::optional<uint64_t> push(std::string_view payload,
+								 uint8_t qos) override;
+	bool hasPending() const override { return m_read < m_entries.size(); }
+	std::string_view peek() const override {
+		return m_entries[m_read].payload;
+	}
+	uint8_t peekQos() const override { return m_entries[m_read].qos; }
+	uint64_t advance() override;
+	void markPublished(uint64_t id) override;
+	void ack(uint64_t id) override;
+	void rewind() override;
+	size_t size() const override { return m_count; }
+	size_t bytes() const override { return m_bytes; }
+	size_t dropped() const override { return m_dropped; }
+
+	size_t maxEntries() const { return m_max_entries; }
+	size_t maxBytes() const { return m_max_bytes; }
+
+   private:
+	bool fits(size_t payload_size) const {
+		return (m_max_entries == 0 || m_count + 1 <= m_max_entries) &&
+			   (m_max_bytes == 0 || m_bytes + payload_size <= m_max_bytes);
+	}
+
+	/**
+	 * Gets the index of the entry with an ID, or the number of entries if
+	 * there is none.
+	 */
+	size_t find(uint64_t id) const;
+
+	/**
+	 * Moves the read cursor past the entries that were already published.
+	 */
+	void skipPublished();
+
+	/**
+	 * Discards the oldest entry, and then any acked entries after it.
+	 */
+	void popFront();
+
+	void dropOldest();
+
+	/**
+	 * Doubles the decimation stride, discarding the unpublished entries that
+	 * are no longer on it.
+	 * @return false if there were too few entries to thin out.
+	 */
+	bool decimate();
+
+	struct Entry {
+		std::string payload;  // Cleared once acked
+		uint64_t id;
+		// Position in the sequence of entries pushed since the store last had
+		// none waiting to be published, used for decimation
+		uint64_t seq;
+		uint8_t qos;
+		bool published;
+		bool acked;
+	};
+
+	// Entries by increasing ID. Acked entries are only removed once every
+	// entry before them is, so the front entry is never acked.
+	std::deque<Entry> m_entries;
+	size_t m_read{0};  // Index of the next entry to publish
+	uint64_t m_next_id{0};
+	size_t m_count{0};	// Unacked entries
+	size_t m_bytes{0};
+
+	size_t m_max_entries;
+	size_t m_max_bytes;
+	OverflowPolicy m_policy;
+	size_t m_dropped{0};
+
+	// Only entries whose sequence number is a multiple of the stride are kept
+	// while decimating, so the entries left are evenly spaced over the whole
+	// outage. The first entry is on every stride, so it is always kept.
+	uint64_t m_next_seq{0};
+	uint64_t m_stride{1};
+};
@@ -0,0 +1,213 @@
+#include "reactor.hpp"
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include "controller.hpp"
+
+Reactor::Reactor()
+	: m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+	  m_self(std::make_shared<Reactor*>(this)) {
+	if (m_epoll_fd < 0) {
+		throw std::runtime_error("Failed to create epoll instance");
+	}
+}
+
+Reactor::~Reactor() {
+	*m_self = nullptr;
+	close(m_epoll_fd);
+}
+
+void Reactor::add(Controller* controller) {
+	auto [it, inserted] = m_ids.try_emplace(controller, m_next_id);
+	if (!inserted) {
+		return;
+	}
+
+	uint64_t id = m_next_id++;
+	Entry& entry = m_entries.emplace(id, Entry{controller}).first->second;
+	controller->setWakeupListener([self = m_self, id]() {
+		if (*self != nullptr) {
+			(*self)->touch(id);
+		}
+	});
+
+	// Service the controller on the next poll
+	m_deadlines.emplace(entry.due, id);
+}
+
+bool Reactor::remove(Controller* controller) {
+	auto it = m_ids.find(controller);
+	if (it == m_ids.end()) {
+		return false;
+	}
+
+	// Only unregister the socket if it is still the controller's, as a closed
+	// socket's number may already belong to another controller
+	Entry& entry = m_entries.at(it->second);
+	if (entry.fd >= 0 && entry.fd == controller->socket()) {
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, entry.fd, nullptr);
+	}
+	controller->setWakeupListener(nullptr);
+	m_deadlines.erase({entry.due, it->second});
+	m_entries.erase(it->second);
+	m_ids.erase(it);
+	return true;
+}
+
+size_t Reactor::poll(int timeout_ms) {
+	if (timeout_ms < 0 || timeout_ms > 1000) {
+		timeout_ms = 1000;
+	}
+
+	// Reschedule the controllers that queued data, added timers or connected
+	// since they were last serviced
+	int64_t now = steadyTimestamp();
+	for (uint64_t id : m_touched) {
+		auto it = m_entries.find(id);
+		if (it != m_entries.end() && it->second.touched) {
+			reschedule(id, it->second, now);
+		}
+	}
+	m_touched.clear();
+
+	// Don't sleep past the timers, flushes and replays of any controller
+	if (!m_deadlines.empty()) {
+		int64_t until_due = m_deadlines.begin()->first - now;
+		timeout_ms =
+			static_cast<int>(std::clamp<int64_t>(until_due, 0, timeout_ms));
+	}
+
+	m_events.resize(m_entries.empty() ? 1 : m_entries.size());
+	int count = epoll_wait(m_epoll_fd, m_events.data(),
+						   static_cast<int>(m_events.size()), timeout_ms);
+	if (count < 0) {
+		count = 0;	// Interrupted by a signal
+	}
+
+	// Copy the ready IDs first, as handling an event can add or remove
+	// controllers
+	m_ready.clear();
+	for (int i = 0; i < count; ++i) {
+		m_ready.push_back(m_events[i].data.u64);
+	}
+	for (int i = 0; i < count; ++i) {
+		auto it = m_entries.find(m_ready[i]);
+		if (it == m_entries.end()) {
+			continue;  // Removed while handling an earlier event
+		}
+		Controller* controller = it->second.controller;
+		uint32_t events = m_events[i].events;
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			controller->loopRead();
+		}
+		if ((events & EPOLLOUT) && m_entries.count(m_ready[i]) != 0) {
+			controller->loopWrite();
+		}
+
+		// Forget a socket closed by a lost connection now, as reconnecting
+		// from loopMisc() below usually reuses its number
+		it = m_entries.find(m_ready[i]);
+		if (it != m_entries.end() && controller->socket() < 0) {
+			it->second.fd = -1;
+			it->second.events = 0;
+		}
+	}
+
+	// Service the controllers with socket activity, as acks may let them
+	// replay more, then the controllers that are due. The due IDs are copied
+	// first, as servicing reschedules them.
+	for (uint64_t id : m_ready) {
+		service(id);
+	}
+	now = steadyTimestamp();
+	m_due.clear();
+	for (auto it = m_deadlines.begin();
+		 it != m_deadlines.end() && it->first <= now; ++it) {
+		m_due.push_back(it->second);
+	}
+	for (uint64_t id : m_due) {
+		service(id);
+	}
+
+	return static_cast<size_t>(count);
+}
+
+void Reactor::touch(uint64_t id) {
+	auto it = m_entries.find(id);
+	if (it != m_entries.end() && !it->second.touched) {
+		it->second.touched = true;
+		m_touched.push_back(id);
+	}
+}
+
+void Reactor::reschedule(uint64_t id, Entry& entry, int64_t now) {
+	updateInterest(id, entry);
+
+	m_deadlines.erase({entry.due, id});
+	entry.due = now + entry.controller->nextWakeup();
+	m_deadlines.emplace(entry.due, id);
+	entry.touched = false;
+}
+
+void Reactor::service(uint64_t id) {
+	auto it = m_entries.find(id);
+	if (it == m_entries.end()) {
+		return;	 // Removed while servicing another controller
+	}
+	it->second.controller->loopMisc();
+
+	// Callbacks run by loopMisc() may have removed the controller
+	it = m_entries.find(id);
+	if (it != m_entries.end()) {
+		reschedule(id, it->second, steadyTimestamp());
+	}
+}
+
+int64_t Reactor::steadyTimestamp() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+void Reactor::updateInterest(uint64_t id, Entry& entry) {
+	int fd = entry.controller->socket();
+	uint32_t events =
+		fd >= 0 ? EPOLLIN | (entry.controller->wantWrite() ? EPOLLOUT : 0) : 0;
+	if (fd == entry.fd && events == entry.events) {
+		return;
+	}
+
+	// The old socket has been closed, which already removed it from the epoll
+	// set. It isn't deleted here, as its number may have been reused by
+	// another controller's socket.
+	if (fd < 0) {
+		entry.fd = -1;
+		entry.events = 0;
+		return;
+	}
+
+	struct epoll_event event {};
+	event.events = events;
+	event.data.u64 = id;
+
+	int rc = epoll_ctl(m_epoll_fd, fd == entry.fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+					   fd, &event);
+	if (rc != 0 && errno == ENOENT) {
+		// A new socket reusing the number of the closed one isn't registered
+		rc = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	} else if (rc != 0 && errno == EEXIST) {
+		rc = epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+	}
+
+	if (rc != 0) {
+		// Try again on the next poll
+		entry.fd = -1;
+		entry.events = 0;
+		return;
+	}
+	entry.fd = fd;
+	entry.events = events;
+}
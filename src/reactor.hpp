@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Controller;
+
+/**
+ * Drives any number of controllers from a single thread using epoll.
+ *
+ * Instead of each controller blocking in its own loop(), the sockets of all
+ * controllers are waited on together, and only the controllers whose socket is
+ * ready have their packets read or written. The next wakeup of each controller
+ * is kept in an ordered set, so that only the controllers with socket activity
+ * or a due timer, flush, replay or keepalive are serviced on each poll.
+ */
+class Reactor {
+   public:
+	/**
+	 * @throws std::runtime_error if the epoll instance can't be created.
+	 */
+	Reactor();
+	~Reactor();
+
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+
+	/**
+	 * Adds a controller to drive. Adding the same controller again does
+	 * nothing.
+	 */
+	void add(Controller* controller);
+
+	/**
+	 * Stops driving a controller.
+	 * @return true if the controller was added, false otherwise.
+	 */
+	bool remove(Controller* controller);
+
+	size_t size() const { return m_entries.size(); }
+
+	/**
+	 * Waits for socket activity, then services the controllers that had
+	 * activity or are due.
+	 * @param timeout_ms The maximum time to wait (ms). Waits end early when a
+	 * controller's timer, flush or replay is due, and are capped at one second
+	 * so that keepalives are sent in time. A negative timeout waits for one
+	 * second.
+	 * @return The number of controllers that had socket activity.
+	 */
+	size_t poll(int timeout_ms);
+
+   private:
+	struct Entry {
+		Controller* controller;
+		int fd{-1};
+		uint32_t events{0};
+		int64_t due{0};		  // Next wakeup, from steadyTimestamp()
+		bool touched{false};  // Listed in m_touched
+	};
+
+	/**
+	 * Updates the epoll registration of an entry, as the socket of a
+	 * controller changes when reconnecting and write interest depends on
+	 * whether data is waiting.
+	 */
+	void updateInterest(uint64_t id, Entry& entry);
+
+	/**
+	 * Records that a controller has to be rescheduled before the next wait.
+	 */
+	void touch(uint64_t id);
+
+	/**
+	 * Updates the socket registration and next wakeup of an entry.
+	 * @param now The current steadyTimestamp().
+	 */
+	void reschedule(uint64_t id, Entry& entry, int64_t now);
+
+	/**
+	 * Lets a controller send keepalives, reconnect, replay and flush, then
+	 * reschedules it.
+	 */
+	void service(uint64_t id);
+
+	static int64_t steadyTimestamp();
+
+	int m_epoll_fd{-1};
+
+	// Entries by ID, which is stored in the epoll events rather than a pointer
+	// so that events of removed entries are ignored
+	std::unordered_map<uint64_t, Entry> m_entries;
+	std::unordered_map<Controller*, uint64_t> m_ids;
+	uint64_t m_next_id{0};
+
+	// Next wakeup and ID of every entry, earliest first
+	std::set<std::pair<int64_t, uint64_t>> m_deadlines;
+	// Entries whose next wakeup may have changed outside of poll()
+	std::vector<uint64_t> m_touched;
+	// Pointer to the reactor for the wakeup listeners of the controllers,
+	// cleared when destroyed as the controllers may outlive it
+	std::shared_ptr<Reactor*> m_self;
+
+	std::vector<uint64_t> m_ready;	// Reused between polls
+	std::vector<uint64_t> m_due;	// Reused between polls
+	std::vector<struct epoll_event> m_events;
+};
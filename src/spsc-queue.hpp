@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/**
+ * Queue passing messages from exactly one producer thread to exactly one
+ * consumer thread.
+ *
+ * Messages go through a bounded ring buffer without taking a lock. The head
+ * and tail indices live on separate cache lines, and each side keeps a cached
+ * copy of the other side's index so that it only reads the shared one when
+ * the ring looks full or empty.
+ *
+ * When the ring is full, messages go to a mutex protected overflow list
+ * instead of being dropped or blocking the producer. Once a message has
+ * overflowed, later messages also go to the list until the consumer takes it,
+ * so messages are always received in the order they were sent.
+ */
+template <typename Msg>
+class SpscQueue final {
+   public:
+	/**
+	 * @param capacity The number of messages the ring buffer holds, rounded up
+	 * to a power of two.
+	 */
+	explicit SpscQueue(size_t capacity = 1024) {
+		size_t size = 2;
+		while (size < capacity) {
+			size *= 2;
+		}
+		m_slots.resize(size);
+		m_mask = size - 1;
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	/**
+	 * Get the number of messages in the queue.
+	 * Must only be called from the consumer thread, and is only exact while
+	 * the producer is idle.
+	 */
+	size_t size() const {
+		size_t ring = m_tail.value.load(std::memory_order_acquire) -
+					  m_head.value.load(std::memory_order_acquire);
+		std::lock_guard<std::mutex> lock(m_overflow_mutex);
+		return ring + m_overflow.size() + m_taken.size();
+	}
+
+	/**
+	 * Construct a message and push it onto the queue.
+	 * Must only be called from the producer thread.
+	 */
+	template <typename... Args>
+	void emplace(Args&&... args) {
+		if (try_emplace(std::forward<Args>(args)...)) {
+			return;
+		}
+
+		// The ring is full, or earlier messages are waiting in the overflow
+		std::lock_guard<std::mutex> lock(m_overflow_mutex);
+		m_overflow.push_back(Msg{std::forward<Args>(args)...});
+		m_overflowing.store(true, std::memory_order_release);
+	}
+
+	/**
+	 * Construct a message and push it onto the queue, only if it fits in the
+	 * ring buffer.
+	 * Must only be called from the producer thread.
+	 * @return true if the message was pushed, false if the ring is full or
+	 * messages are waiting in the overflow. The arguments are left untouched
+	 * if the message wasn't pushed.
+	 */
+	template <typename... Args>
+	bool try_emplace(Args&&... args) {
+		if (m_overflowing.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		size_t tail = m_tail.value.load(std::memory_order_relaxed);
+		if (tail - m_cached_head >= m_slots.size()) {
+			m_cached_head = m_head.value.load(std::memory_order_acquire);
+			if (tail - m_cached_head >= m_slots.size()) {
+				return false;
+			}
+		}
+
+		m_slots[tail & m_mask] = Msg{std::forward<Args>(args)...};
+		m_tail.value.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Pop a message from the queue. If the queue is empty, returns
+	 * std::nullopt.
+	 * Must only be called from the consumer thread.
+	 */
+	std::optional<Msg> pop() {
+		// Overflowed messages that were taken are older than anything in the
+		// ring
+		if (!m_taken.empty()) {
+			Msg msg = std::move(m_taken.front());
+			m_taken.pop_front();
+			return msg;
+		}
+
+		size_t head = m_head.value.load(std::memory_order_relaxed);
+		bool overflowing = false;
+		if (head == m_cached_tail) {
+			// Check the overflow before the tail, so that any message pushed to
+			// the ring before the overflow started is seen
+			overflowing = m_overflowing.load(std::memory_order_acquire);
+			m_cached_tail = m_tail.value.load(std::memory_order_acquire);
+		}
+		if (head != m_cached_tail) {
+			Msg msg = std::move(m_slots[head & m_mask]);
+			m_head.value.store(head + 1, std::memory_order_release);
+			return msg;
+		}
+
+		// The ring is empty, so the overflow holds the oldest messages
+		if (overflowing) {
+			{
+				std::lock_guard<std::mutex> lock(m_overflow_mutex);
+				m_taken.swap(m_overflow);
+				m_overflowing.store(false, std::memory_order_release);
+			}
+			return pop();
+		}
+
+		return std::nullopt;
+	}
+
+	/**
+	 * Move all messages out of the queue. The ring indices are read and
+	 * published once for the whole batch, and the overflow lock is only taken
+	 * if messages overflowed.
+	 * Must only be called from the consumer thread.
+	 * @param out Receives the messages, after any it already holds.
+	 * @return The number of messages moved out.
+	 */
+	size_t drain(std::vector<Msg>& out) {
+		size_t count = out.size();
+
+		for (Msg& msg : m_taken) {
+			out.push_back(std::move(msg));
+		}
+		m_taken.clear();
+
+		// Check the overflow before the tail, as in pop()
+		bool overflowing = m_overflowing.load(std::memory_order_acquire);
+		size_t head = m_head.value.load(std::memory_order_relaxed);
+		m_cached_tail = m_tail.value.load(std::memory_order_acquire);
+		for (; head != m_cached_tail; ++head) {
+			out.push_back(std::move(m_slots[head & m_mask]));
+		}
+		m_head.value.store(head, std::memory_order_release);
+
+		if (overflowing) {
+			{
+				std::lock_guard<std::mutex> lock(m_overflow_mutex);
+				m_taken.swap(m_overflow);
+				m_overflowing.store(false, std::memory_order_release);
+			}
+			for (Msg& msg : m_taken) {
+				out.push_back(std::move(msg));
+			}
+			m_taken.clear();
+		}
+
+		return out.size() - count;
+	}
+
+   private:
+	// Keeps an index on its own cache line, so that the producer and consumer
+	// don't invalidate each other's cache when updating their index
+	struct alignas(64) Index {
+		std::atomic<size_t> value{0};
+	};
+
+	std::vector<Msg> m_slots;
+	size_t m_mask;
+
+	// Next slot to read, written by the consumer
+	Index m_head;
+	// Next slot to write, written by the producer
+	Index m_tail;
+
+	// Copies of the other side's index, only used by one side each
+	alignas(64) size_t m_cached_head{0};  // Producer
+	alignas(64) size_t m_cached_tail{0};  // Consumer
+
+	// Messages that didn't fit in the ring, in order
+	mutable std::mutex m_overflow_mutex;
+	std::deque<Msg> m_overflow;
+	std::atomic<bool> m_overflowing{false};
+	// Overflowed messages taken by the consumer, only used by the consumer
+	std::deque<Msg> m_taken;
+};
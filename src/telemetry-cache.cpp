@@ -0,0 +1,96 @@
+#include "telemetry-cache.hpp"
+#include <algorithm>
+#include <cmath>
+
+TelemetryCache::Handle TelemetryCache::intern(const char* key) {
+	auto [it, inserted] = m_index.try_emplace(key, m_keys.size());
+	if (inserted) {
+		m_keys.emplace_back(key);
+		m_quoted_keys.push_back(nlohmann::json(key).dump());
+		m_values.emplace_back();
+		m_timestamps.push_back(0);
+
+		// Grow the bitsets a word at a time
+		if (m_keys.size() > m_dirty_bits.size() * 64) {
+			m_present_bits.push_back(0);
+			m_dirty_bits.push_back(0);
+		}
+	}
+	return it->second;
+}
+
+void TelemetryCache::set(Handle handle, nlohmann::json&& value, int64_t ts) {
+	m_values[handle] = std::move(value);
+	m_timestamps[handle] = ts;
+	m_present_bits[handle / 64] |= uint64_t{1} << (handle % 64);
+}
+
+void TelemetryCache::setNumber(Handle handle, double value, int64_t ts) {
+	nlohmann::json& stored = m_values[handle];
+	if (isIntegral(value)) {
+		auto number = static_cast<nlohmann::json::number_integer_t>(value);
+		if (auto* ptr = stored.get_ptr<nlohmann::json::number_integer_t*>()) {
+			*ptr = number;
+		} else {
+			stored = number;
+		}
+	} else if (auto* ptr = stored.get_ptr<nlohmann::json::number_float_t*>()) {
+		*ptr = value;
+	} else {
+		stored = value;
+	}
+	m_timestamps[handle] = ts;
+	m_present_bits[handle / 64] |= uint64_t{1} << (handle % 64);
+}
+
+void TelemetryCache::setBool(Handle handle, bool value, int64_t ts) {
+	nlohmann::json& stored = m_values[handle];
+	if (auto* ptr = stored.get_ptr<nlohmann::json::boolean_t*>()) {
+		*ptr = value;
+	} else {
+		stored = value;
+	}
+	m_timestamps[handle] = ts;
+	m_present_bits[handle / 64] |= uint64_t{1} << (handle % 64);
+}
+
+bool TelemetryCache::equalsNumber(Handle handle, double value) const {
+	const nlohmann::json& stored = m_values[handle];
+	if (auto* ptr =
+			stored.get_ptr<const nlohmann::json::number_integer_t*>()) {
+		return static_cast<double>(*ptr) == value;
+	}
+	if (auto* ptr =
+			stored.get_ptr<const nlohmann::json::number_unsigned_t*>()) {
+		return static_cast<double>(*ptr) == value;
+	}
+	if (auto* ptr = stored.get_ptr<const nlohmann::json::number_float_t*>()) {
+		return *ptr == value;
+	}
+	return false;
+}
+
+bool TelemetryCache::isIntegral(double value) {
+	// 2^63, the first value that doesn't fit in an int64_t
+	static const double limit = 9223372036854775808.0;
+	double integral;
+	return std::modf(value, &integral) == 0.0 && value >= -limit &&
+		   value < limit;
+}
+
+void TelemetryCache::markDirty(Handle handle) {
+	uint64_t& word = m_dirty_bits[handle / 64];
+	uint64_t mask = uint64_t{1} << (handle % 64);
+	if ((word & mask) == 0) {
+		word |= mask;
+		++m_dirty_count;
+	}
+}
+
+void TelemetryCache::clearDirty() {
+	if (m_dirty_count == 0) {
+		return;
+	}
+	std::fill(m_dirty_bits.begin(), m_dirty_bits.end(), 0);
+	m_dirty_count = 0;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/**
+ * Stores the latest value of each telemetry key.
+ * Keys are interned once into a dense slot index, with the values, timestamps
+ * and dirty flags kept in parallel arrays indexed by that slot. Updating a key
+ * by handle therefore touches no hash table, and finding the dirty keys is a
+ * linear scan of a bitset.
+ */
+class TelemetryCache {
+   public:
+	typedef size_t Handle;
+
+	/**
+	 * Registers a key, returning its handle.
+	 * Registering the same key again returns the same handle.
+	 */
+	Handle intern(const char* key);
+
+	/**
+	 * Checks if a handle was returned by intern().
+	 */
+	bool contains(Handle handle) const { return handle < m_keys.size(); }
+
+	/**
+	 * Gets the number of registered keys.
+	 */
+	size_t size() const { return m_keys.size(); }
+
+	const std::string& key(Handle handle) const { return m_keys[handle]; }
+
+	/**
+	 * Gets the key escaped and quoted for writing into a JSON payload.
+	 */
+	const std::string& quotedKey(Handle handle) const {
+		return m_quoted_keys[handle];
+	}
+
+	/**
+	 * Checks if a value has been set for the key.
+	 */
+	bool hasValue(Handle handle) const {
+		return testBit(m_present_bits, handle);
+	}
+
+	const nlohmann::json& value(Handle handle) const {
+		return m_values[handle];
+	}
+
+	/**
+	 * Gets the time the value was measured (ms).
+	 */
+	int64_t timestamp(Handle handle) const { return m_timestamps[handle]; }
+
+	/**
+	 * Stores a value without marking the key dirty.
+	 */
+	void set(Handle handle, nlohmann::json&& value, int64_t ts);
+
+	/**
+	 * Stores a number without marking the key dirty, writing into the stored
+	 * value in place when it already holds a number of the same kind.
+	 * Integral values are stored as integers.
+	 */
+	void setNumber(Handle handle, double value, int64_t ts);
+
+	/**
+	 * Stores a boolean without marking the key dirty, writing into the stored
+	 * value in place when it already holds a boolean.
+	 */
+	void setBool(Handle handle, bool value, int64_t ts);
+
+	/**
+	 * Checks if the stored value is a number equal to a value, without boxing
+	 * the value into JSON.
+	 */
+	bool equalsNumber(Handle handle, double value) const;
+
+	/**
+	 * Checks if the stored value is a boolean equal to a value.
+	 */
+	bool equalsBool(Handle handle, bool value) const {
+		const bool* stored =
+			m_values[handle].get_ptr<const nlohmann::json::boolean_t*>();
+		return stored != nullptr && *stored == value;
+	}
+
+	/**
+	 * Checks if a number is sent as an integer, which is the case when it has
+	 * no fractional part and fits in an integer.
+	 */
+	static bool isIntegral(double value);
+
+	void markDirty(Handle handle);
+
+	bool isDirty(Handle handle) const { return testBit(m_dirty_bits, handle); }
+
+	/**
+	 * Gets the number of dirty keys.
+	 */
+	size_t dirtyCount() const { return m_dirty_count; }
+
+	/**
+	 * Calls fn(handle) for each dirty key, in handle order.
+	 */
+	template <typename Fn>
+	void forEachDirty(Fn&& fn) const {
+		for (size_t word = 0; word < m_dirty_bits.size(); ++word) {
+			uint64_t bits = m_dirty_bits[word];
+			while (bits != 0) {
+				fn(word * 64 + countTrailingZeros(bits));
+				bits &= bits - 1;  // Clear the lowest set bit
+			}
+		}
+	}
+
+	/**
+	 * Marks all keys as clean.
+	 */
+	void clearDirty();
+
+   private:
+	static bool testBit(const std::vector<uint64_t>& bits, Handle handle) {
+		return (bits[handle / 64] >> (handle % 64)) & 1;
+	}
+
+	static unsigned countTrailingZeros(uint64_t bits) {
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return index;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+
+	std::unordered_map<std::string, Handle> m_index;
+
+	// Parallel arrays indexed by handle
+	std::vector<std::string> m_keys;
+	std::vector<std::string> m_quoted_keys;
+	std::vector<nlohmann::json> m_values;
+	std::vector<int64_t> m_timestamps;
+
+	// Bitsets indexed by handle
+	std::vector<uint64_t> m_present_bits;
+	std::vector<uint64_t> m_dirty_bits;
+	size_t m_dirty_count{0};
+};
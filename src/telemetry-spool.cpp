@@ -0,0 +1,364 @@
+#include "telemetry-spool.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+TelemetrySpool::TelemetrySpool(const std::string& directory,
+							   size_t segment_size,
+							   size_t max_segments)
+	: m_directory(directory),
+	  m_segment_size(std::max(segment_size, sizeof(Header) + 64)),
+	  m_max_segments(std::max<size_t>(max_segments, 1)) {
+	std::filesystem::create_directories(m_directory);
+
+	// Find the existing segment files, in order
+	std::vector<std::pair<uint64_t, std::string>> files;
+	for (const auto& entry : std::filesystem::directory_iterator(m_directory)) {
+		std::string name = entry.path().filename().string();
+		unsigned long long seq;
+		char suffix[8];
+		if (sscanf(name.c_str(), "spool-%llu.%4s", &seq, suffix) == 2 &&
+			strcmp(suffix, "seg") == 0) {
+			files.emplace_back(seq, entry.path().string());
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	// Recover the entries of each segment
+	for (const auto& [seq, path] : files) {
+		Segment segment{seq, path, nullptr, 0};
+		int fd = open(path.c_str(), O_RDWR);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 ||
+			static_cast<size_t>(st.st_size) < sizeof(Header) ||
+			!mapSegment(segment, fd, st.st_size)) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			unlink(path.c_str());
+			continue;
+		}
+
+		Header* header = segment.header();
+		if (header->magic != MAGIC || header->ack_offset < sizeof(Header) ||
+			header->ack_offset > header->write_offset ||
+			header->write_offset > segment.size) {
+			munmap(segment.data, segment.size);
+			unlink(path.c_str());
+			continue;
+		}
+
+		// Count the unacked entries, cutting off any partially written entry
+		uint32_t offset = header->ack_offset;
+		while (offset < header->write_offset) {
+			if (offset + ENTRY_HEADER_SIZE > header->write_offset ||
+				offset + ENTRY_HEADER_SIZE + entryLength(segment, offset) >
+					header->write_offset) {
+				header->write_offset = offset;
+				break;
+			}
+			uint32_t length = entryLength(segment, offset);
+			if (!(entryFlags(segment, offset) & FLAG_ACKED)) {
+				++m_count;
+				m_bytes += length;
+			}
+			offset += ENTRY_HEADER_SIZE + length;
+		}
+
+		m_segments.push_back(segment);
+		m_next_seq = seq + 1;
+	}
+
+	discardAcked();
+	rewind();
+}
+
+TelemetrySpool::~TelemetrySpool() {
+	for (const Segment& segment : m_segments) {
+		munmap(segment.data, segment.size);
+	}
+}
+
+std::optional<uint64_t> TelemetrySpool::push(std::string_view payload,
+											 uint8_t qos) {
+	uint32_t length = static_cast<uint32_t>(payload.size());
+	size_t record_size = ENTRY_HEADER_SIZE + length;
+
+	if (m_segments.empty() || m_segments.back().header()->write_offset +
+									  record_size >
+								  m_segments.back().size) {
+		openSegment(sizeof(Header) + record_size);
+	}
+
+	// Write the entry before moving the write offset, so a crash part way
+	// through doesn't leave a partial entry behind
+	Segment& segment = m_segments.back();
+	uint32_t offset = segment.header()->write_offset;
+	memcpy(segment.data + offset, &length, sizeof(length));
+	segment.data[offset + sizeof(length)] = qos & FLAG_QOS_MASK;
+	memcpy(segment.data + offset + ENTRY_HEADER_SIZE, payload.data(), length);
+	segment.header()->write_offset = offset + record_size;
+
+	++m_count;
+	m_bytes += length;
+	return entryId(segment, offset);
+}
+
+bool TelemetrySpool::hasPending() const {
+	auto [index, offset] = readPosition();
+	return index < m_segments.size() &&
+		   offset < m_segments[index].header()->write_offset;
+}
+
+std::string_view TelemetrySpool::peek() const {
+	auto [index, offset] = readPosition();
+	const Segment& segment = m_segments[index];
+	const uint8_t* payload = segment.data + offset + ENTRY_HEADER_SIZE;
+	return std::string_view(reinterpret_cast<const char*>(payload),
+							entryLength(segment, offset));
+}
+
+uint8_t TelemetrySpool::peekQos() const {
+	auto [index, offset] = readPosition();
+	return entryFlags(m_segments[index], offset) & FLAG_QOS_MASK;
+}
+
+uint64_t TelemetrySpool::advance() {
+	auto [index, offset] = readPosition();
+	const Segment& segment = m_segments[index];
+	m_read_segment = index;
+	m_read_offset = offset + ENTRY_HEADER_SIZE + entryLength(segment, offset);
+	uint64_t id = entryId(segment, offset);
+	skipPublished();
+	return id;
+}
+
+void TelemetrySpool::markPublished(uint64_t id) {
+	size_t index = find(id);
+	if (index == m_segments.size() ||
+		isPublished(index, static_cast<uint32_t>(id))) {
+		return;
+	}
+
+	m_published_ahead.insert(id);
+	skipPublished();
+}
+
+void TelemetrySpool::ack(uint64_t id) {
+	size_t index = find(id);
+	uint32_t offset = static_cast<uint32_t>(id);
+	if (index == m_segments.size() || !isPublished(index, offset)) {
+		return;	 // Dropped, or not published yet
+	}
+
+	const Segment& segment = m_segments[index];
+	entryFlags(segment, offset) |= FLAG_ACKED;
+	m_published_ahead.erase(id);
+	--m_count;
+	m_bytes -= entryLength(segment, offset);
+	discardAcked();
+}
+
+void TelemetrySpool::rewind() {
+	m_read_segment = 0;
+	m_read_offset = m_segments.empty() ? sizeof(Header)
+									   : m_segments.front().header()->ack_offset;
+	m_published_ahead.clear();
+	skipPublished();
+}
+
+void TelemetrySpool::openSegment(size_t min_size) {
+	// Flush the full segment to disk, so that only the entries of the segment
+	// being written can be lost if the system goes down
+	if (!m_segments.empty()) {
+		const Segment& back = m_segments.back();
+		msync(back.data, back.size, MS_SYNC);
+	}
+
+	// Make room by dropping the oldest segment
+	if (m_segments.size() >= m_max_segments) {
+		dropFrontSegment();
+	}
+
+	Segment segment{m_next_seq++, "", nullptr, 0};
+	segment.path = m_directory + "/spool-" + std::to_string(segment.seq) + ".seg";
+
+	size_t size = std::max(m_segment_size, min_size);
+	int fd = open(segment.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create spool segment");
+	}
+	if (ftruncate(fd, static_cast<off_t>(size)) != 0 ||
+		!mapSegment(segment, fd, size)) {
+		close(fd);
+		unlink(segment.path.c_str());
+		throw std::runtime_error("Failed to map spool segment");
+	}
+
+	Header* header = segment.header();
+	header->magic = MAGIC;
+	header->write_offset = sizeof(Header);
+	header->ack_offset = sizeof(Header);
+	header->reserved = 0;
+
+	m_segments.push_back(segment);
+}
+
+bool TelemetrySpool::mapSegment(Segment& segment, int fd, size_t size) {
+	void* data =
+		mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	// The mapping stays valid after the file is closed
+	close(fd);
+	segment.data = static_cast<uint8_t*>(data);
+	segment.size = size;
+	return true;
+}
+
+void TelemetrySpool::dropFrontSegment() {
+	const Segment& front = m_segments.front();
+	const Header* header = front.header();
+
+	// Account for the unacked entries that are lost. Acks for those that were
+	// published are ignored once the segment is gone.
+	uint32_t offset = header->ack_offset;
+	while (offset < header->write_offset) {
+		uint32_t length = entryLength(front, offset);
+		if (!(entryFlags(front, offset) & FLAG_ACKED)) {
+			--m_count;
+			m_bytes -= length;
+			++m_dropped;
+		}
+		offset += ENTRY_HEADER_SIZE + length;
+	}
+	uint64_t next_id = (front.seq + 1) << 32;
+	m_published_ahead.erase(m_published_ahead.begin(),
+							m_published_ahead.lower_bound(next_id));
+
+	releaseFrontSegment();
+}
+
+void TelemetrySpool::releaseFrontSegment() {
+	const Segment& front = m_segments.front();
+	munmap(front.data, front.size);
+	unlink(front.path.c_str());
+	m_segments.pop_front();
+
+	// Move the read cursor to the new oldest segment if it was in the
+	// released one
+	if (m_read_segment > 0) {
+		--m_read_segment;
+	} else {
+		m_read_offset = m_segments.empty()
+							? sizeof(Header)
+							: m_segments.front().header()->ack_offset;
+	}
+}
+
+uint32_t TelemetrySpool::entryLength(const Segment& segment, uint32_t offset) {
+	uint32_t length;
+	memcpy(&length, segment.data + offset, sizeof(length));
+	return length;
+}
+
+size_t TelemetrySpool::find(uint64_t id) const {
+	uint64_t seq = id >> 32;
+	uint32_t offset = static_cast<uint32_t>(id);
+	for (size_t index = 0; index < m_segments.size(); ++index) {
+		const Segment& segment = m_segments[index];
+		if (segment.seq != seq) {
+			continue;
+		}
+		const Header* header = segment.header();
+		if (offset >= header->ack_offset && offset < header->write_offset &&
+			!(entryFlags(segment, offset) & FLAG_ACKED)) {
+			return index;
+		}
+		break;
+	}
+	return m_segments.size();
+}
+
+bool TelemetrySpool::isPublished(size_t index, uint32_t offset) const {
+	if (index < m_read_segment ||
+		(index == m_read_segment && offset < m_read_offset)) {
+		return true;
+	}
+	return m_published_ahead.count(entryId(m_segments[index], offset)) > 0;
+}
+
+std::pair<size_t, uint32_t> TelemetrySpool::readPosition() const {
+	size_t index = m_read_segment;
+	uint32_t offset = m_read_offset;
+	while (index < m_segments.size()) {
+		const Segment& segment = m_segments[index];
+		if (offset >= segment.header()->write_offset) {
+			if (index + 1 == m_segments.size()) {
+				break;
+			}
+			++index;
+			offset = m_segments[index].header()->ack_offset;
+			continue;
+		}
+
+		// Skip the entries that were published ahead of the cursor
+		if (!(entryFlags(segment, offset) & FLAG_ACKED) &&
+			m_published_ahead.count(entryId(segment, offset)) == 0) {
+			break;
+		}
+		offset += ENTRY_HEADER_SIZE + entryLength(segment, offset);
+	}
+	return {index, offset};
+}
+
+void TelemetrySpool::skipPublished() {
+	auto [index, offset] = readPosition();
+	m_read_segment = index;
+	m_read_offset = offset;
+	if (m_segments.empty()) {
+		m_published_ahead.clear();
+	} else {
+		m_published_ahead.erase(
+			m_published_ahead.begin(),
+			m_published_ahead.lower_bound(entryId(m_segments[index], offset)));
+	}
+}
+
+void TelemetrySpool::discardAcked() {
+	while (!m_segments.empty()) {
+		Segment& front = m_segments.front();
+		Header* header = front.header();
+		while (header->ack_offset < header->write_offset &&
+			   (entryFlags(front, header->ack_offset) & FLAG_ACKED)) {
+			header->ack_offset +=
+				ENTRY_HEADER_SIZE + entryLength(front, header->ack_offset);
+		}
+		if (header->ack_offset < header->write_offset) {
+			return;
+		}
+
+		if (m_segments.size() > 1) {
+			releaseFrontSegment();
+			continue;
+		}
+
+		// Reuse the only segment from the start, under a new sequence number
+		// so that the IDs of its old entries aren't handed out again. The file
+		// keeps its name, which still sorts before those of newer segments.
+		header->write_offset = sizeof(Header);
+		header->ack_offset = sizeof(Header);
+		front.seq = m_next_seq++;
+		m_read_offset = sizeof(Header);
+		return;
+	}
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <set>
+#include <string>
+#include <utility>
+#include "offline-store.hpp"
+
+/**
+ * Offline store persisted to memory-mapped segment files.
+ *
+ * Entries are appended to fixed-size segment files in a directory, each
+ * starting with a header holding the segment's write and ack offsets. Each
+ * entry is stored as its payload length and a flags byte holding its QoS level
+ * and whether it was acked, followed by the payload. The ack offset is moved
+ * past entries once every entry before them is acked. As the cursors live in
+ * the mapped files, unacked entries survive a crash or restart of the process
+ * and are picked up again when the spool is reopened. Segments are only synced
+ * to disk when full, so a power loss or kernel crash can lose the entries of
+ * the segment being written. Once every entry of a segment is acked, the
+ * segment file is deleted.
+ *
+ * The ID of an entry is the sequence number of its segment in the upper 32
+ * bits and its offset in the lower 32 bits.
+ *
+ * Disk usage is bounded by the maximum number of segments. When a new segment
+ * is needed and the limit is reached, the oldest segment is dropped.
+ */
+class TelemetrySpool final : public OfflineStore {
+   public:
+	/**
+	 * Opens a spool, recovering any entries left in the directory.
+	 * @param directory The directory holding the segment files, created if it
+	 * doesn't exist.
+	 * @param segment_size The size of each segment file in bytes.
+	 * @param max_segments The maximum number of segment files.
+	 * @throws std::runtime_error if the segment files can't be created or
+	 * mapped.
+	 */
+	TelemetrySpool(const std::string& directory,
+				   size_t segment_size,
+				   size_t max_segments);
+	~TelemetrySpool() override;
+
+	TelemetrySpool(const TelemetrySpool&) = delete;
+	TelemetrySpool& operator=(const TelemetrySpool&) = delete;
+
+	std::optional<uint64_t> push(std::string_view payload,
+								 uint8_t qos) override;
+	bool hasPending() const override;
+	std::string_view peek() const override;
+	uint8_t peekQos() const override;
+	uint64_t advance() override;
+	void markPublished(uint64_t id) override;
+	void ack(uint64_t id) override;
+	void rewind() override;
+	size_t size() const override { return m_count; }
+	size_t bytes() const override { return m_bytes; }
+	size_t dropped() const override { return m_dropped; }
+
+   private:
+	struct Header {
+		uint32_t magic;
+		uint32_t write_offset;
+		uint32_t ack_offset;
+		uint32_t reserved;
+	};
+
+	struct Segment {
+		uint64_t seq;  // Changed when the segment is reused
+		std::string path;
+		uint8_t* data;
+		size_t size;
+
+		Header* header() const { return reinterpret_cast<Header*>(data); }
+	};
+
+	static const uint32_t MAGIC = 0x32505354;  // "TSP2"
+
+	// Size of the length and flags preceding the payload of each entry
+	static const uint32_t ENTRY_HEADER_SIZE = sizeof(uint32_t) + 1;
+	// Bits of the entry flags holding the QoS level
+	static const uint8_t FLAG_QOS_MASK = 0x03;
+	static const uint8_t FLAG_ACKED = 0x04;
+
+	void openSegment(size_t min_size);
+	bool mapSegment(Segment& segment, int fd, size_t size);
+
+	/**
+	 * Deletes the oldest segment along with any entries left in it.
+	 */
+	void dropFrontSegment();
+
+	/**
+	 * Unmaps and deletes the oldest segment.
+	 */
+	void releaseFrontSegment();
+
+	/**
+	 * Gets the length of the entry at an offset of a segment.
+	 */
+	static uint32_t entryLength(const Segment& segment, uint32_t offset);
+
+	/**
+	 * Gets the flags of the entry at an offset of a segment.
+	 */
+	static uint8_t& entryFlags(const Segment& segment, uint32_t offset) {
+		return segment.data[offset + sizeof(uint32_t)];
+	}
+
+	static uint64_t entryId(const Segment& segment, uint32_t offset) {
+		return (segment.seq << 32) | offset;
+	}
+
+	/**
+	 * Finds the unacked entry with an ID.
+	 * @return The index of its segment, or the number of segments if there is
+	 * no such entry.
+	 */
+	size_t find(uint64_t id) const;
+
+	/**
+	 * Checks if the entry at an offset of a segment was published, either
+	 * before the read cursor or ahead of it.
+	 */
+	bool isPublished(size_t index, uint32_t offset) const;
+
+	/**
+	 * Gets the read cursor, moved past the end of exhausted segments and past
+	 * entries that were acked or published ahead of it.
+	 * @return The index of the segment and the offset within it.
+	 */
+	std::pair<size_t, uint32_t> readPosition() const;
+
+	/**
+	 * Moves the read cursor to readPosition(), forgetting the entries
+	 * published ahead of it that it passed.
+	 */
+	void skipPublished();
+
+	/**
+	 * Moves the ack offsets past acked entries, releasing fully acked
+	 * segments.
+	 */
+	void discardAcked();
+
+	std::string m_directory;
+	size_t m_segment_size;
+	size_t m_max_segments;
+	uint64_t m_next_seq{0};
+
+	std::deque<Segment> m_segments;
+
+	// Read cursor, not persisted as unacked entries are resent after a
+	// restart anyway
+	size_t m_read_segment{0};
+	uint32_t m_read_offset{sizeof(Header)};
+
+	// IDs of the entries published ahead of the read cursor
+	std::set<uint64_t> m_published_ahead;
+
+	size_t m_count{0};
+	size_t m_bytes{0};
+	size_t m_dropped{0};
+};
@@ -0,0 +1,65 @@
+#include "telemetry-writer.hpp"
+#include <charconv>
+
+TelemetryWriter::TelemetryWriter()
+	: m_serializer(nlohmann::detail::output_adapter<char>(m_buffer), ' ') {}
+
+void TelemetryWriter::begin(bool array) {
+	m_buffer.clear();
+	m_array = array;
+	m_entry_open = false;
+	if (m_array) {
+		m_buffer.push_back('[');
+	}
+}
+
+void TelemetryWriter::add(int64_t ts,
+						  std::string_view quoted_key,
+						  const nlohmann::json& value) {
+	if (m_entry_open && ts == m_entry_ts) {
+		m_buffer.push_back(',');
+	} else {
+		// Close the previous entry and start a new one
+		if (m_entry_open) {
+			m_buffer.append("}},");
+		}
+		m_buffer.append("{\"ts\":");
+		char digits[24];
+		auto result = std::to_chars(digits, digits + sizeof(digits), ts);
+		m_buffer.append(digits, result.ptr);
+		m_buffer.append(",\"values\":{");
+
+		m_entry_open = true;
+		m_entry_ts = ts;
+	}
+
+	m_buffer.append(quoted_key);
+	m_buffer.push_back(':');
+	m_serializer.dump(value, false, false, 0);
+}
+
+std::string_view TelemetryWriter::finish() {
+	if (m_entry_open) {
+		m_buffer.append("}}");
+		m_entry_open = false;
+	}
+	if (m_array) {
+		m_buffer.push_back(']');
+	}
+	return m_buffer;
+}
+
+void TelemetryWriter::rollback(const Checkpoint& checkpoint) {
+	m_buffer.resize(checkpoint.size);
+	m_entry_ts = checkpoint.entry_ts;
+	m_entry_open = checkpoint.entry_open;
+}
+
+void TelemetryWriter::appendArrayElements(std::string& buffer,
+										  std::string_view payload) {
+	if (!payload.empty() && payload.front() == '[') {
+		buffer.append(payload.substr(1, payload.size() - 2));
+	} else {
+		buffer.append(payload);
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+
+/**
+ * Serializes telemetry payloads straight into a reusable buffer.
+ * Values are written one at a time as they are read from the cache, so no
+ * intermediate JSON objects are built, and the buffer keeps its capacity
+ * between payloads.
+ *
+ * A payload is either a single entry, `{"ts":...,"values":{...}}`, or an array
+ * of entries. Consecutive values with the same timestamp share an entry.
+ */
+class TelemetryWriter {
+   public:
+	/**
+	 * A position in the payload that can be returned to with rollback().
+	 */
+	struct Checkpoint {
+		size_t size;
+		int64_t entry_ts;
+		bool entry_open;
+
+		/**
+		 * Checks if no values had been written at this position.
+		 */
+		bool empty() const { return !entry_open; }
+	};
+
+	TelemetryWriter();
+	TelemetryWriter(const TelemetryWriter&) = delete;
+	TelemetryWriter& operator=(const TelemetryWriter&) = delete;
+
+	/**
+	 * Discards the current payload and starts a new one, keeping the
+	 * allocated buffer.
+	 * @param array Whether the payload is an array of entries. If not, all
+	 * values must have the same timestamp.
+	 */
+	void begin(bool array);
+
+	/**
+	 * Writes a value to the payload.
+	 * @param ts The timestamp of the value (ms).
+	 * @param quoted_key The key, already escaped and surrounded by quotes.
+	 * @param value The value to write.
+	 */
+	void add(int64_t ts, std::string_view quoted_key, const nlohmann::json& value);
+
+	/**
+	 * Closes the payload.
+	 * @return The payload, valid until the next call to begin().
+	 */
+	std::string_view finish();
+
+	/**
+	 * Gets the size the payload will have once closed.
+	 */
+	size_t finishedSize() const {
+		return m_buffer.size() + (m_entry_open ? 2 : 0) + (m_array ? 1 : 0);
+	}
+
+	Checkpoint checkpoint() const {
+		return Checkpoint{m_buffer.size(), m_entry_ts, m_entry_open};
+	}
+
+	/**
+	 * Removes everything written since the checkpoint.
+	 */
+	void rollback(const Checkpoint& checkpoint);
+
+	/**
+	 * Appends the entries of a telemetry payload to an array being built,
+	 * unwrapping the payload if it is itself an array.
+	 */
+	static void appendArrayElements(std::string& buffer,
+									std::string_view payload);
+
+   private:
+	// Must be declared before the serializer that writes into it
+	std::string m_buffer;
+	nlohmann::detail::serializer<nlohmann::json> m_serializer;
+
+	bool m_array{false};
+	bool m_entry_open{false};
+	int64_t m_entry_ts{0};
+};
@@ -50,11 +50,35 @@ class ThreadSafeQueue final {
 		if (m_queue.empty()) {
 			return std::nullopt;
 		}
-		Msg msg = m_queue.front();
+		Msg msg = std::move(m_queue.front());
 		m_queue.pop();
 		return msg;
 	}
 
+	/**
+	 * Move all messages out of the queue, taking the lock only once.
+	 * @param out Receives the messages, after any it already holds.
+	 * @return The number of messages moved out.
+	 */
+	size_t drain(std::queue<Msg>& out) {
+		std::queue<Msg> taken;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.swap(taken);
+		}
+
+		size_t count = taken.size();
+		if (out.empty()) {
+			out.swap(taken);
+		} else {
+			while (!taken.empty()) {
+				out.push(std::move(taken.front()));
+				taken.pop();
+			}
+		}
+		return count;
+	}
+
    private:
 	std::queue<Msg> m_queue;
 	std::mutex m_mutex;
@@ -0,0 +1,73 @@
+#include "timer-heap.hpp"
+#include <utility>
+
+size_t TimerHeap::add(int64_t due, int64_t interval, Callback callback) {
+	size_t id = m_next_id++;
+	m_timers.emplace(id, Timer{interval, std::move(callback), due});
+	m_heap.push(Entry{due, id});
+	return id;
+}
+
+bool TimerHeap::cancel(size_t id) {
+	return m_timers.erase(id) > 0;
+}
+
+std::optional<int64_t> TimerHeap::nextDue() {
+	discardStale();
+	if (m_heap.empty()) {
+		return std::nullopt;
+	}
+	return m_heap.top().due;
+}
+
+void TimerHeap::runDue(int64_t now) {
+	// Only run the entries due now, so a callback adding a timer that is
+	// already due can't keep this looping
+	std::vector<Entry> due;
+	discardStale();
+	while (!m_heap.empty() && m_heap.top().due <= now) {
+		due.push_back(m_heap.top());
+		m_heap.pop();
+		discardStale();
+	}
+
+	for (const Entry& entry : due) {
+		auto it = m_timers.find(entry.id);
+		if (it == m_timers.end()) {
+			continue;  // Cancelled by an earlier callback
+		}
+
+		// Move the callback out, as it may cancel its own timer
+		Callback callback = std::move(it->second.callback);
+		int64_t interval = it->second.interval;
+		if (interval <= 0) {
+			m_timers.erase(it);
+		}
+
+		callback();
+
+		if (interval > 0) {
+			it = m_timers.find(entry.id);
+			if (it != m_timers.end()) {
+				// Skip the missed calls if the callback fell behind
+				int64_t next = entry.due + interval;
+				if (next <= now) {
+					next = now + interval;
+				}
+				it->second.callback = std::move(callback);
+				it->second.due = next;
+				m_heap.push(Entry{next, entry.id});
+			}
+		}
+	}
+}
+
+void TimerHeap::discardStale() {
+	while (!m_heap.empty()) {
+		auto it = m_timers.find(m_heap.top().id);
+		if (it != m_timers.end() && it->second.due == m_heap.top().due) {
+			break;
+		}
+		m_heap.pop();
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Schedules one-shot and periodic callbacks on a monotonic clock.
+ * Due times are kept in a binary min-heap, so finding the next due timer is
+ * constant time and adding a timer is logarithmic. Cancelled timers are
+ * removed lazily when they reach the top of the heap.
+ */
+class TimerHeap {
+   public:
+	typedef std::function<void()> Callback;
+
+	/**
+	 * Adds a timer.
+	 * @param due The time the callback is first due (ms).
+	 * @param interval The time between calls (ms), or 0 to only call once.
+	 * @param callback The function to call.
+	 * @return The ID of the timer.
+	 */
+	size_t add(int64_t due, int64_t interval, Callback callback);
+
+	/**
+	 * Cancels a timer. Can be called from within a timer callback.
+	 * @return true if the timer was active, false otherwise.
+	 */
+	bool cancel(size_t id);
+
+	bool empty() const { return m_timers.empty(); }
+
+	/**
+	 * Gets the time the next timer is due (ms), if any.
+	 */
+	std::optional<int64_t> nextDue();
+
+	/**
+	 * Calls the callbacks of all timers due at a time, rescheduling periodic
+	 * timers. Timers added by the callbacks are first called on a later run.
+	 */
+	void runDue(int64_t now);
+
+   private:
+	struct Timer {
+		int64_t interval;
+		Callback callback;
+		int64_t due;
+	};
+
+	struct Entry {
+		int64_t due;
+		size_t id;
+
+		bool operator>(const Entry& other) const { return due > other.due; }
+	};
+
+	/**
+	 * Pops the entries of cancelled and rescheduled timers off the top.
+	 */
+	void discardStale();
+
+	std::unordered_map<size_t, Timer> m_timers;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> m_heap;
+	size_t m_next_id{1};
+};
@@ -0,0 +1,473 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "controller.hpp"
+#include "fake-mosquitto.hpp"
+#include "thingsmqtt-config.hpp"
+
+class ControllerTest : public ::testing::Test {
+   protected:
+	void SetUp() override {
+		fake_mosquitto::reset();
+		m_config.host = "localhost";
+	}
+
+	/**
+	 * Connects the controller, forgetting what it published when connecting.
+	 */
+	void connect() {
+		m_controller.connect(m_config);
+		fake_mosquitto::connect();
+		fake_mosquitto::published().clear();
+	}
+
+	/**
+	 * Gets the payloads published to a topic.
+	 */
+	static std::vector<std::string> payloads(const char* topic) {
+		std::vector<std::string> result;
+		for (const fake_mosquitto::Message& message :
+			 fake_mosquitto::published()) {
+			if (message.topic == topic) {
+				result.push_back(message.payload);
+			}
+		}
+		return result;
+	}
+
+	ControllerConfig m_config;
+	Controller m_controller;
+};
+
+TEST_F(ControllerTest, SendsLatestValueWithoutBatching) {
+	connect();
+	m_controller.publishTelemetry("temp", 1, 1000);
+	m_controller.publishTelemetry("temp", 2, 2000);
+	EXPECT_TRUE(m_controller.send());
+
+	ASSERT_EQ(fake_mosquitto::published().size(), 1u);
+	const fake_mosquitto::Message& message = fake_mosquitto::published()[0];
+	EXPECT_EQ(message.topic, THINGSMQTT_TELEMETRY_TOPIC);
+	EXPECT_EQ(message.payload, "{\"ts\":2000,\"values\":{\"temp\":2}}");
+	EXPECT_EQ(message.qos, 1);
+
+	// Nothing changed since
+	EXPECT_FALSE(m_controller.send());
+}
+
+TEST_F(ControllerTest, BatchesEverySample) {
+	m_config.batch_telemetry = true;
+	connect();
+	m_controller.publishTelemetry("temp", 1, 1000);
+	m_controller.publishTelemetry("hum", 5, 1000);
+	m_controller.publishTelemetry("temp", 1, 2000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "[{\"ts\":1000,\"values\":{\"temp\":1,\"hum\":5}},"
+				  "{\"ts\":2000,\"values\":{\"temp\":1}}]"}));
+}
+
+TEST_F(ControllerTest, BatchingReplacesSamplesWithTheSameTimestamp) {
+	m_config.batch_telemetry = true;
+	connect();
+	m_controller.publishTelemetry("temp", 1, 1000);
+	m_controller.publishTelemetry("temp", 2, 1000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "[{\"ts\":1000,\"values\":{\"temp\":2}}]"}));
+}
+
+TEST_F(ControllerTest, FiltersSmallChanges) {
+	connect();
+	TelemetryFilter filter;
+	filter.deadband = 0.5;
+	m_controller.setTelemetryFilter("temp", filter);
+
+	m_controller.publishTelemetry("temp", 10.0, 1000);
+	m_controller.send();
+	m_controller.publishTelemetry("temp", 10.25, 2000);
+	EXPECT_FALSE(m_controller.send());
+	m_controller.publishTelemetry("temp", 11.0, 3000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"temp\":10.0}}",
+				  "{\"ts\":3000,\"values\":{\"temp\":11.0}}"}));
+}
+
+TEST_F(ControllerTest, FiltersByInterval) {
+	connect();
+	TelemetryFilter filter;
+	filter.min_interval = 1000;
+	filter.max_silence = 5000;
+	m_controller.setTelemetryFilter("temp", filter);
+
+	// Changes within the minimum interval are dropped, and an unchanged value
+	// is sent once the key has been silent for too long
+	m_controller.publishTelemetry("temp", 1, 1000);
+	m_controller.send();
+	m_controller.publishTelemetry("temp", 2, 1500);
+	EXPECT_FALSE(m_controller.send());
+	m_controller.publishTelemetry("temp", 1, 4000);
+	EXPECT_FALSE(m_controller.send());
+	m_controller.publishTelemetry("temp", 1, 6000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"temp\":1}}",
+				  "{\"ts\":6000,\"values\":{\"temp\":1}}"}));
+}
+
+TEST_F(ControllerTest, SplitsLargePayloads) {
+	m_config.max_payload_size = 36;
+	connect();
+	m_controller.publishTelemetry("a", 1, 1000);
+	m_controller.publishTelemetry("b", 2, 1000);
+	m_controller.publishTelemetry("c", 3, 1000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"a\":1,\"b\":2}}",
+				  "{\"ts\":1000,\"values\":{\"c\":3}}"}));
+}
+
+TEST_F(ControllerTest, SendsValueLargerThanMaxPayloadSize) {
+	m_config.max_payload_size = 20;
+	connect();
+	m_controller.publishTelemetry("a", 1, 1000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{"{\"ts\":1000,\"values\":{\"a\":1}}"}));
+}
+
+TEST_F(ControllerTest, FlushesOnceEnoughIsPending) {
+	m_config.max_pending_count = 2;
+	connect();
+	m_controller.publishTelemetry("a", 1, 1000);
+	m_controller.loopMisc();
+	EXPECT_TRUE(fake_mosquitto::published().empty());
+
+	m_controller.publishTelemetry("b", 2, 1000);
+	EXPECT_EQ(m_controller.nextWakeup(), 0);
+	m_controller.loopMisc();
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"a\":1,\"b\":2}}"}));
+}
+
+TEST_F(ControllerTest, FlushesOncePendingDataIsOld) {
+	m_config.max_pending_age = 20;
+	connect();
+	m_controller.publishTelemetry("a", 1, 1000);
+	EXPECT_LE(m_controller.nextWakeup(), 20);
+	m_controller.loopMisc();
+	EXPECT_TRUE(fake_mosquitto::published().empty());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	EXPECT_EQ(m_controller.nextWakeup(), 0);
+	m_controller.loopMisc();
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC).size(), 1u);
+}
+
+TEST_F(ControllerTest, AggregatesEachWindow) {
+	connect();
+	m_controller.setTelemetryAggregation(
+		"temp", AggregateMin | AggregateMax | AggregateAvg | AggregateCount);
+
+	m_controller.publishTelemetry("temp", 1, 1000);
+	m_controller.publishTelemetry("temp", 3, 2000);
+	m_controller.publishTelemetry("temp", 2, 3000);
+	m_controller.send();
+
+	// The statistics start over in the next window
+	m_controller.publishTelemetry("temp", 5, 4000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":3000,\"values\":{\"temp_min\":1.0,\"temp_max\":3.0,"
+				  "\"temp_avg\":2.0,\"temp_count\":3}}",
+				  "{\"ts\":4000,\"values\":{\"temp_min\":5.0,\"temp_max\":5.0,"
+				  "\"temp_avg\":5.0,\"temp_count\":1}}"}));
+}
+
+TEST_F(ControllerTest, KeepsTelemetryUntilAcked) {
+	connect();
+	m_controller.publishTelemetry("a", 1, 1000);
+	m_controller.send();
+	m_controller.publishTelemetry("a", 2, 2000);
+	m_controller.send();
+	ASSERT_EQ(fake_mosquitto::published().size(), 2u);
+	EXPECT_EQ(m_controller.offlineStore().size(), 2u);
+
+	// Acks can arrive out of order
+	fake_mosquitto::ack(fake_mosquitto::published()[1].mid);
+	EXPECT_EQ(m_controller.offlineStore().size(), 1u);
+
+	// The unacked message is published again after reconnecting
+	fake_mosquitto::disconnect();
+	fake_mosquitto::connect();
+	fake_mosquitto::published().clear();
+	m_controller.loopMisc();
+	ASSERT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{"{\"ts\":1000,\"values\":{\"a\":1}}"}));
+
+	fake_mosquitto::ack(fake_mosquitto::published()[0].mid);
+	EXPECT_TRUE(m_controller.offlineStore().empty());
+}
+
+TEST_F(ControllerTest, PublishesLiveTelemetryDuringReplay) {
+	m_config.replay_window = 4;
+	m_config.replay_batch_size = 1;	 // Replay each entry on its own
+	connect();
+	fake_mosquitto::disconnect();
+	for (int i = 0; i < 5; ++i) {
+		m_controller.publishTelemetry("a", i, 1000 * (i + 1));
+		m_controller.send();
+	}
+
+	// A quarter of the window is left for live telemetry
+	fake_mosquitto::connect();
+	m_controller.loopMisc();
+	EXPECT_EQ(fake_mosquitto::published().size(), 3u);
+
+	m_controller.publishTelemetry("b", 1, 9000);
+	m_controller.send();
+	ASSERT_EQ(fake_mosquitto::published().size(), 4u);
+	EXPECT_EQ(fake_mosquitto::published()[3].payload,
+			  "{\"ts\":9000,\"values\":{\"b\":1}}");
+	EXPECT_TRUE(m_controller.offlineStore().hasPending());
+
+	// Once the window is full, live telemetry is replayed with the backlog
+	m_controller.publishTelemetry("b", 2, 10000);
+	m_controller.send();
+	EXPECT_EQ(fake_mosquitto::published().size(), 4u);
+
+	for (int i = 0; i < 4; ++i) {
+		fake_mosquitto::ack(fake_mosquitto::published()[i].mid);
+	}
+	EXPECT_EQ(m_controller.offlineStore().size(), 3u);
+	m_controller.loopMisc();
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"a\":0}}",
+				  "{\"ts\":2000,\"values\":{\"a\":1}}",
+				  "{\"ts\":3000,\"values\":{\"a\":2}}",
+				  "{\"ts\":9000,\"values\":{\"b\":1}}",
+				  "{\"ts\":4000,\"values\":{\"a\":3}}",
+				  "{\"ts\":5000,\"values\":{\"a\":4}}",
+				  "{\"ts\":10000,\"values\":{\"b\":2}}"}));
+}
+
+TEST_F(ControllerTest, ResendsOnlyUnackedAttributes) {
+	connect();
+	m_controller.setAttribute("a", 1);
+	m_controller.setAttribute("b", 2);
+	m_controller.send();
+	ASSERT_EQ(fake_mosquitto::published().size(), 1u);
+	const fake_mosquitto::Message& message = fake_mosquitto::published()[0];
+	EXPECT_EQ(message.topic, THINGSMQTT_ATTRIBUTES_TOPIC);
+	EXPECT_EQ(message.payload, "{\"a\":1,\"b\":2}");
+	EXPECT_EQ(message.qos, 1);
+	fake_mosquitto::ack(message.mid);
+
+	m_controller.setAttribute("b", 3);
+	m_controller.send();
+
+	// Only the change that was never acknowledged is sent again
+	fake_mosquitto::disconnect();
+	fake_mosquitto::connect();
+	EXPECT_EQ(payloads(THINGSMQTT_ATTRIBUTES_TOPIC),
+			  (std::vector<std::string>{"{\"a\":1,\"b\":2}", "{\"b\":3}",
+										"{\"b\":3}"}));
+}
+
+TEST_F(ControllerTest, RestoresAckedAttributesFromStateFile) {
+	std::string path = ::testing::TempDir() + "thingsmqtt-attributes.json";
+	std::remove(path.c_str());
+	m_config.attribute_state_file = path.c_str();
+	connect();
+	m_controller.setAttribute("a", 1);
+	m_controller.setAttribute("b", 2);
+	m_controller.send();
+	fake_mosquitto::ack(fake_mosquitto::published()[0].mid);
+
+	// After a restart, only attributes that differ from the acknowledged
+	// values are sent
+	fake_mosquitto::reset();
+	Controller controller;
+	controller.setAttribute("a", 1);
+	controller.setAttribute("b", 5);
+	controller.connect(m_config);
+	fake_mosquitto::connect();
+	EXPECT_EQ(payloads(THINGSMQTT_ATTRIBUTES_TOPIC),
+			  (std::vector<std::string>{"{\"b\":5}"}));
+	std::remove(path.c_str());
+}
+
+TEST_F(ControllerTest, SplitsTelemetryByQos) {
+	connect();
+	m_controller.setTelemetryQos("fast", MqttQos::AtMostOnce);
+	m_controller.publishTelemetry("fast", 1, 1000);
+	m_controller.publishTelemetry("slow", 2, 1000);
+	m_controller.send();
+
+	ASSERT_EQ(fake_mosquitto::published().size(), 2u);
+	for (const fake_mosquitto::Message& message :
+		 fake_mosquitto::published()) {
+		EXPECT_EQ(message.topic, THINGSMQTT_TELEMETRY_TOPIC);
+		if (message.qos == 0) {
+			EXPECT_EQ(message.payload, "{\"ts\":1000,\"values\":{\"fast\":1}}");
+		} else {
+			EXPECT_EQ(message.qos, 1);
+			EXPECT_EQ(message.payload, "{\"ts\":1000,\"values\":{\"slow\":2}}");
+		}
+	}
+
+	// Only the acknowledged stream is tracked
+	EXPECT_EQ(m_controller.offlineStore().size(), 1u);
+}
+
+TEST_F(ControllerTest, ReplaysAtTheQosItWasSentAt) {
+	connect();
+	fake_mosquitto::disconnect();
+	m_controller.setTelemetryQos("fast", MqttQos::AtMostOnce);
+	m_controller.publishTelemetry("a", 1, 1000);
+	m_controller.publishTelemetry("fast", 1, 1000);
+	m_controller.send();
+	m_controller.setTelemetryQos("a", MqttQos::ExactlyOnce);
+	m_controller.publishTelemetry("a", 2, 2000);
+	m_controller.send();
+
+	// Fire and forget telemetry isn't queued, and entries of different QoS
+	// levels aren't merged
+	fake_mosquitto::connect();
+	m_controller.loopMisc();
+	ASSERT_EQ(fake_mosquitto::published().size(), 2u);
+	EXPECT_EQ(fake_mosquitto::published()[0].payload,
+			  "{\"ts\":1000,\"values\":{\"a\":1}}");
+	EXPECT_EQ(fake_mosquitto::published()[0].qos, 1);
+	EXPECT_EQ(fake_mosquitto::published()[1].payload,
+			  "{\"ts\":2000,\"values\":{\"a\":2}}");
+	EXPECT_EQ(fake_mosquitto::published()[1].qos, 2);
+}
+
+TEST_F(ControllerTest, PublishesTypedValues) {
+	connect();
+	Controller::TelemetryHandle temp =
+		m_controller.registerTelemetryKey("temp");
+	Controller::TelemetryHandle count =
+		m_controller.registerTelemetryKey("count");
+	Controller::TelemetryHandle on = m_controller.registerTelemetryKey("on");
+	m_controller.publishTelemetryNumber(temp, 21.5, 1000);
+	m_controller.publishTelemetryNumber(count, 3, 1000);
+	m_controller.publishTelemetryBool(on, true, 1000);
+	m_controller.send();
+
+	// Unchanged values are compared in place and not sent again
+	m_controller.publishTelemetryNumber(temp, 21.5, 2000);
+	m_controller.publishTelemetryBool(on, true, 2000);
+	EXPECT_FALSE(m_controller.send());
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"temp\":21.5,\"count\":3,"
+				  "\"on\":true}}"}));
+}
+
+TEST_F(ControllerTest, FiltersTypedValues) {
+	connect();
+	TelemetryFilter filter;
+	filter.deadband = 0.5;
+	m_controller.setTelemetryFilter("temp", filter);
+	Controller::TelemetryHandle temp =
+		m_controller.registerTelemetryKey("temp");
+
+	m_controller.publishTelemetryNumber(temp, 10, 1000);
+	m_controller.send();
+	m_controller.publishTelemetryNumber(temp, 10.25, 2000);
+	EXPECT_FALSE(m_controller.send());
+	m_controller.publishTelemetryNumber(temp, 11, 3000);
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"ts\":1000,\"values\":{\"temp\":10}}",
+				  "{\"ts\":3000,\"values\":{\"temp\":11}}"}));
+}
+
+TEST_F(ControllerTest, SendsGatewayDeviceData) {
+	connect();
+	Controller::DeviceHandle sensor = m_controller.registerDevice("sensor");
+	Controller::DeviceHandle meter = m_controller.registerDevice("meter");
+	EXPECT_EQ(m_controller.registerDevice("sensor"), sensor);
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_CONNECT_TOPIC),
+			  (std::vector<std::string>{"{\"device\":\"sensor\"}",
+										"{\"device\":\"meter\"}"}));
+
+	m_controller.publishDeviceTelemetry(sensor, "temp", 20, 1000);
+	m_controller.publishDeviceTelemetry(meter, "power", 5, 2000);
+	m_controller.setDeviceAttribute(meter, "model", "m1");
+	m_controller.send();
+
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_TELEMETRY_TOPIC),
+			  (std::vector<std::string>{
+				  "{\"sensor\":[{\"ts\":1000,\"values\":{\"temp\":20}}],"
+				  "\"meter\":[{\"ts\":2000,\"values\":{\"power\":5}}]}"}));
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_ATTRIBUTES_TOPIC),
+			  (std::vector<std::string>{"{\"meter\":{\"model\":\"m1\"}}"}));
+
+	// Device telemetry isn't queued in the offline store
+	EXPECT_TRUE(m_controller.offlineStore().empty());
+}
+
+TEST_F(ControllerTest, ResendsOnlyUnackedDeviceAttributes) {
+	connect();
+	Controller::DeviceHandle sensor = m_controller.registerDevice("sensor");
+	Controller::DeviceHandle meter = m_controller.registerDevice("meter");
+	m_controller.setDeviceAttribute(sensor, "model", "s1");
+	m_controller.send();
+	ASSERT_FALSE(fake_mosquitto::published().empty());
+	fake_mosquitto::ack(fake_mosquitto::published().back().mid);
+
+	m_controller.setDeviceAttribute(meter, "model", "m1");
+	m_controller.send();
+
+	// The devices are announced again, but only the attributes that were never
+	// acknowledged are sent
+	fake_mosquitto::disconnect();
+	fake_mosquitto::connect();
+	fake_mosquitto::published().clear();
+	m_controller.send();
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_ATTRIBUTES_TOPIC),
+			  (std::vector<std::string>{"{\"meter\":{\"model\":\"m1\"}}"}));
+}
+
+TEST_F(ControllerTest, PacesGatewayAnnouncements) {
+	m_config.replay_window = 4;
+	m_config.replay_rate = 100.0;
+	m_controller.connect(m_config);
+	for (const char* name : {"a", "b", "c", "d", "e"}) {
+		m_controller.registerDevice(name);
+	}
+
+	// The initial burst leaves a quarter of the window for live telemetry
+	fake_mosquitto::connect();
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_CONNECT_TOPIC).size(), 3u);
+	EXPECT_GT(m_controller.nextWakeup(), 0);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	m_controller.loopMisc();
+	EXPECT_EQ(payloads(THINGSMQTT_GATEWAY_CONNECT_TOPIC).size(), 5u);
+}
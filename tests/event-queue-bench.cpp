@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc-queue.hpp"
+#include "threadsafe-queue.hpp"
+
+// Compares the mutex protected ThreadSafeQueue against the lock-free
+// SpscQueue under a stream of RPC requests. A producer thread, standing in for
+// the mosquitto network thread, pushes events carrying a topic and payload at
+// a fixed rate while the consumer, standing in for loop(), pops them. The
+// rates are below the consumer's throughput, so the queue doesn't grow and
+// each event's time from push to pop measures the latency of the queue itself
+// rather than the depth of a backlog. Each queue is consumed both one pop() at
+// a time and in batches with drain(). The last
+// run also hands the strings of consumed events back to the producer through
+// a second SpscQueue, as MqttClientThreadSafe does, so that steady state
+// doesn't allocate.
+
+using Clock = std::chrono::steady_clock;
+
+static const size_t EVENTS = 200000;
+
+// Events pushed per second
+static const double RATES[] = {100000.0, 400000.0};
+
+struct Event {
+	std::string topic;
+	std::string payload;
+	Clock::time_point pushed;
+};
+
+// Consumes the available events one at a time
+template <typename Queue, typename Fn>
+static void popEvents(Queue& queue, Fn&& fn) {
+	while (auto event = queue.pop()) {
+		fn(*event);
+	}
+}
+
+// Consumes the available events in one batch
+template <typename Fn>
+static void drainEvents(ThreadSafeQueue<Event>& queue, Fn&& fn) {
+	static std::queue<Event> events;
+	queue.drain(events);
+	while (!events.empty()) {
+		fn(events.front());
+		events.pop();
+	}
+}
+
+template <typename Fn>
+static void drainEvents(SpscQueue<Event>& queue, Fn&& fn) {
+	static std::vector<Event> events;
+	queue.drain(events);
+	for (Event& event : events) {
+		fn(event);
+	}
+	events.clear();
+}
+
+template <typename Queue>
+static void benchmark(const char* name,
+					  Queue& queue,
+					  bool drain,
+					  double rate,
+					  SpscQueue<std::string>* pool = nullptr) {
+	std::vector<int64_t> latencies;
+	latencies.reserve(EVENTS);
+
+	Clock::time_point start = Clock::now();
+	std::thread producer([&queue, rate, start, pool]() {
+		auto take = [pool]() {
+			if (pool) {
+				if (auto buffer = pool->pop()) {
+					return std::move(*buffer);
+				}
+			}
+			return std::string();
+		};
+		char id[32];
+		for (size_t i = 0; i < EVENTS; ++i) {
+			// Spin until the event is due, as sleeping is far too coarse.
+			// Yielding lets the consumer run when they share a core.
+			Clock::time_point due =
+				start + std::chrono::duration_cast<Clock::duration>(
+							std::chrono::duration<double>(i / rate));
+			while (Clock::now() < due) {
+				std::this_thread::yield();
+			}
+
+			std::string topic = take();
+			topic.assign("v1/devices/me/rpc/request/");
+			snprintf(id, sizeof(id), "%zu", i);
+			topic.append(id);
+			std::string payload = take();
+			payload.assign(
+				"{\"method\":\"setValue\",\"params\":{\"value\":42}}");
+			queue.emplace(Event{
+				std::move(topic),
+				std::move(payload),
+				Clock::now(),
+			});
+		}
+	});
+
+	auto record = [&latencies, pool](Event& event) {
+		latencies.push_back(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+																 event.pushed)
+				.count());
+		if (pool) {
+			pool->try_emplace(std::move(event.topic));
+			pool->try_emplace(std::move(event.payload));
+		}
+	};
+	while (latencies.size() < EVENTS) {
+		size_t handled = latencies.size();
+		if (drain) {
+			drainEvents(queue, record);
+		} else {
+			popEvents(queue, record);
+		}
+		if (latencies.size() == handled) {
+			std::this_thread::yield();
+		}
+	}
+	producer.join();
+	double seconds =
+		std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		return latencies[static_cast<size_t>(p * (latencies.size() - 1))] /
+			   1000.0;
+	};
+	printf("%-16s %-5s %4.0f k/s | %6.2f M events/s | latency us: p50 %6.2f, "
+		   "p99 %6.2f, p99.9 %7.2f, max %8.1f\n",
+		   name, drain ? "drain" : "pop", rate / 1000.0, EVENTS / seconds / 1e6,
+		   percentile(0.5), percentile(0.99), percentile(0.999),
+		   latencies.back() / 1000.0);
+}
+
+int main() {
+	for (double rate : RATES) {
+		for (bool drain : {false, true}) {
+			ThreadSafeQueue<Event> locked;
+			benchmark("ThreadSafeQueue", locked, drain, rate);
+
+			SpscQueue<Event> ring(1024);
+			benchmark("SpscQueue", ring, drain, rate);
+
+			// A small ring overflows on bursts, exercising the overflow list
+			SpscQueue<Event> small_ring(16);
+			benchmark("SpscQueue (16)", small_ring, drain, rate);
+		}
+
+		SpscQueue<Event> ring(1024);
+		SpscQueue<std::string> pool(256);
+		benchmark("SpscQueue+pool", ring, true, rate, &pool);
+	}
+
+	return 0;
+}
@@ -0,0 +1,223 @@
+#include "fake-mosquitto.hpp"
+#include <mosquitto.h>
+
+struct mosquitto {
+	void* obj;
+	bool connected{false};
+	int next_mid{1};
+
+	void (*on_connect)(struct mosquitto*, void*, int){nullptr};
+	void (*on_disconnect)(struct mosquitto*, void*, int){nullptr};
+	void (*on_publish)(struct mosquitto*, void*, int){nullptr};
+};
+
+namespace {
+
+struct mosquitto* client = nullptr;
+std::vector<fake_mosquitto::Message> messages;
+std::vector<std::string> topics;
+
+}  // namespace
+
+namespace fake_mosquitto {
+
+void reset() {
+	client = nullptr;
+	messages.clear();
+	topics.clear();
+}
+
+std::vector<Message>& published() {
+	return messages;
+}
+
+const std::vector<std::string>& subscriptions() {
+	return topics;
+}
+
+void connect() {
+	client->connected = true;
+	if (client->on_connect != nullptr) {
+		client->on_connect(client, client->obj, 0);
+	}
+}
+
+void disconnect() {
+	client->connected = false;
+	if (client->on_disconnect != nullptr) {
+		client->on_disconnect(client, client->obj, MOSQ_ERR_CONN_LOST);
+	}
+}
+
+void ack(int mid) {
+	if (client->on_publish != nullptr) {
+		client->on_publish(client, client->obj, mid);
+	}
+}
+
+}  // namespace fake_mosquitto
+
+int mosquitto_lib_init(void) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_lib_cleanup(void) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct mosquitto* mosquitto_new(const char* id, bool clean_session, void* obj) {
+	client = new mosquitto{obj};
+	return client;
+}
+
+void mosquitto_destroy(struct mosquitto* mosq) {
+	if (client == mosq) {
+		client = nullptr;
+	}
+	delete mosq;
+}
+
+int mosquitto_username_pw_set(struct mosquitto* mosq,
+							  const char* username,
+							  const char* password) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_tls_set(struct mosquitto* mosq,
+					  const char* cafile,
+					  const char* capath,
+					  const char* certfile,
+					  const char* keyfile,
+					  int (*pw_callback)(char* buf,
+										 int size,
+										 int rwflag,
+										 void* userdata)) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect_delay_set(struct mosquitto* mosq,
+								  unsigned int reconnect_delay,
+								  unsigned int reconnect_delay_max,
+								  bool reconnect_exponential_backoff) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_connect(struct mosquitto* mosq,
+					  const char* host,
+					  int port,
+					  int keepalive) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_connect_bind(struct mosquitto* mosq,
+						   const char* host,
+						   int port,
+						   int keepalive,
+						   const char* bind_address) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect_async(struct mosquitto* mosq) {
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_disconnect(struct mosquitto* mosq) {
+	mosq->connected = false;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_subscribe(struct mosquitto* mosq,
+						int* mid,
+						const char* sub,
+						int qos) {
+	topics.emplace_back(sub);
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_unsubscribe(struct mosquitto* mosq, int* mid, const char* sub) {
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_publish(struct mosquitto* mosq,
+					  int* mid,
+					  const char* topic,
+					  int payloadlen,
+					  const void* payload,
+					  int qos,
+					  bool retain) {
+	if (!mosq->connected) {
+		return MOSQ_ERR_NO_CONN;
+	}
+
+	int message_id = mosq->next_mid++;
+	if (mid != nullptr) {
+		*mid = message_id;
+	}
+	messages.push_back(
+		{topic, std::string(static_cast<const char*>(payload), payloadlen), qos,
+		 message_id});
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop(struct mosquitto* mosq, int timeout, int max_packets) {
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_loop_read(struct mosquitto* mosq, int max_packets) {
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_loop_write(struct mosquitto* mosq, int max_packets) {
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_loop_misc(struct mosquitto* mosq) {
+	return mosq->connected ? MOSQ_ERR_SUCCESS : MOSQ_ERR_NO_CONN;
+}
+
+int mosquitto_socket(struct mosquitto* mosq) {
+	return -1;	// There is no connection to poll
+}
+
+bool mosquitto_want_write(struct mosquitto* mosq) {
+	return false;
+}
+
+void mosquitto_connect_callback_set(struct mosquitto* mosq,
+									void (*on_connect)(struct mosquitto*,
+													   void*,
+													   int)) {
+	mosq->on_connect = on_connect;
+}
+
+void mosquitto_disconnect_callback_set(struct mosquitto* mosq,
+									   void (*on_disconnect)(struct mosquitto*,
+															 void*,
+															 int)) {
+	mosq->on_disconnect = on_disconnect;
+}
+
+void mosquitto_publish_callback_set(struct mosquitto* mosq,
+									void (*on_publish)(struct mosquitto*,
+													   void*,
+													   int)) {
+	mosq->on_publish = on_publish;
+}
+
+void mosquitto_message_callback_set(
+	struct mosquitto* mosq,
+	void (*on_message)(struct mosquitto*,
+					   void*,
+					   const struct mosquitto_message*)) {}
+
+void mosquitto_subscribe_callback_set(
+	struct mosquitto* mosq,
+	void (*on_subscribe)(struct mosquitto*, void*, int, int, const int*)) {}
+
+void mosquitto_unsubscribe_callback_set(
+	struct mosquitto* mosq,
+	void (*on_unsubscribe)(struct mosquitto*, void*, int)) {}
+
+void mosquitto_log_callback_set(
+	struct mosquitto* mosq,
+	void (*on_log)(struct mosquitto*, void*, int, const char*)) {}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * Stands in for libmosquitto in the controller tests.
+ *
+ * Nothing is sent over the network. Published messages are recorded instead,
+ * and the test plays the broker's side of the connection with the functions
+ * below, which call the client's callbacks as libmosquitto would. Only the
+ * most recently created client is driven.
+ */
+namespace fake_mosquitto {
+
+struct Message {
+	std::string topic;
+	std::string payload;
+	int qos;
+	int mid;
+};
+
+/**
+ * Forgets the client, messages and subscriptions of the previous test.
+ */
+void reset();
+
+/**
+ * Gets the messages published while connected, oldest first.
+ */
+std::vector<Message>& published();
+
+/**
+ * Gets the topics subscribed to, in order.
+ */
+const std::vector<std::string>& subscriptions();
+
+/**
+ * Accepts the connection, calling the connect callback.
+ */
+void connect();
+
+/**
+ * Drops the connection, calling the disconnect callback.
+ */
+void disconnect();
+
+/**
+ * Acknowledges a message published at QoS 1 or 2, calling the publish
+ * callback.
+ */
+void ack(int mid);
+
+}  // namespace fake_mosquitto
@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "offline-store.hpp"
+
+TEST(MemoryOfflineStoreTest, KeepsEntriesUntilAcked) {
+	MemoryOfflineStore store;
+	store.push("a", 1);
+	store.push("b", 1);
+
+	ASSERT_TRUE(store.hasPending());
+	EXPECT_EQ(store.peek(), "a");
+	uint64_t a = store.advance();
+	EXPECT_EQ(store.peek(), "b");
+	store.advance();
+	EXPECT_FALSE(store.hasPending());
+	EXPECT_EQ(store.size(), 2u);
+
+	store.ack(a);
+	EXPECT_EQ(store.size(), 1u);
+	EXPECT_EQ(store.bytes(), 1u);
+
+	// The unacked entry is published again after a rewind
+	store.rewind();
+	ASSERT_TRUE(store.hasPending());
+	EXPECT_EQ(store.peek(), "b");
+}
+
+TEST(MemoryOfflineStoreTest, KeepsQosOfEachEntry) {
+	MemoryOfflineStore store;
+	store.push("a", 1);
+	store.push("b", 2);
+
+	EXPECT_EQ(store.peekQos(), 1);
+	store.advance();
+	EXPECT_EQ(store.peekQos(), 2);
+}
+
+TEST(MemoryOfflineStoreTest, AckWithoutPublishingDoesNothing) {
+	MemoryOfflineStore store;
+	std::optional<uint64_t> a = store.push("a", 1);
+	ASSERT_TRUE(a);
+	store.ack(*a);
+	EXPECT_EQ(store.size(), 1u);
+}
+
+TEST(MemoryOfflineStoreTest, PublishesAheadOfTheBacklog) {
+	MemoryOfflineStore store;
+	store.push("a", 1);
+	store.push("b", 1);
+	std::optional<uint64_t> c = store.push("c", 1);
+	ASSERT_TRUE(c);
+
+	// "c" was published as it came in, so only the older entries are left to
+	// replay
+	store.markPublished(*c);
+	EXPECT_EQ(store.peek(), "a");
+	uint64_t a = store.advance();
+	uint64_t b = store.advance();
+	EXPECT_FALSE(store.hasPending());
+
+	// Acks can arrive in any order
+	store.ack(*c);
+	store.ack(a);
+	EXPECT_EQ(store.size(), 1u);
+	EXPECT_EQ(store.bytes(), 1u);
+
+	// Only the unacked entry is published again after a rewind
+	store.rewind();
+	ASSERT_TRUE(store.hasPending());
+	EXPECT_EQ(store.peek(), "b");
+	EXPECT_EQ(store.advance(), b);
+	store.ack(b);
+	EXPECT_TRUE(store.empty());
+}
+
+TEST(MemoryOfflineStoreTest, DropOldest) {
+	MemoryOfflineStore store(3, 0, OverflowPolicy::DropOldest);
+	for (const char* payload : {"a", "b", "c", "d"}) {
+		store.push(payload, 1);
+	}
+
+	EXPECT_EQ(store.size(), 3u);
+	EXPECT_EQ(store.dropped(), 1u);
+	EXPECT_EQ(store.peek(), "b");
+}
+
+TEST(MemoryOfflineStoreTest, DropNewest) {
+	MemoryOfflineStore store(3, 0, OverflowPolicy::DropNewest);
+	for (const char* payload : {"a", "b", "c", "d"}) {
+		store.push(payload, 1);
+	}
+
+	EXPECT_EQ(store.size(), 3u);
+	EXPECT_EQ(store.dropped(), 1u);
+	for (const char* payload : {"a", "b", "c"}) {
+		ASSERT_TRUE(store.hasPending());
+		EXPECT_EQ(store.peek(), payload);
+		store.advance();
+	}
+	EXPECT_FALSE(store.hasPending());
+}
+
+TEST(MemoryOfflineStoreTest, DecimateHalvesTheRate) {
+	MemoryOfflineStore store(4, 0, OverflowPolicy::Decimate);
+	for (const char* payload : {"0", "1", "2", "3", "4", "5", "6"}) {
+		store.push(payload, 1);
+	}
+
+	// Once full, every other entry is dropped, including new ones
+	EXPECT_EQ(store.dropped(), 3u);
+	for (const char* payload : {"0", "2", "4", "6"}) {
+		ASSERT_TRUE(store.hasPending());
+		EXPECT_EQ(store.peek(), payload);
+		store.advance();
+	}
+	EXPECT_FALSE(store.hasPending());
+}
+
+TEST(MemoryOfflineStoreTest, DecimateSpacesEntriesEvenly) {
+	MemoryOfflineStore store(8, 0, OverflowPolicy::Decimate);
+	for (int i = 0; i < 20; ++i) {
+		store.push(std::to_string(i), 1);
+	}
+
+	// The entries left cover the whole outage at the same spacing
+	EXPECT_EQ(store.dropped(), 15u);
+	for (const char* payload : {"0", "4", "8", "12", "16"}) {
+		ASSERT_TRUE(store.hasPending());
+		EXPECT_EQ(store.peek(), payload);
+		store.advance();
+	}
+	EXPECT_FALSE(store.hasPending());
+}
+
+TEST(MemoryOfflineStoreTest, DecimateRestartsOncePublished) {
+	MemoryOfflineStore store(4, 0, OverflowPolicy::Decimate);
+	for (int i = 0; i < 5; ++i) {
+		store.push(std::to_string(i), 1);
+	}
+	while (store.hasPending()) {
+		store.ack(store.advance());
+	}
+
+	// The next outage keeps every entry again until the store is full
+	for (const char* payload : {"a", "b", "c"}) {
+		store.push(payload, 1);
+	}
+	EXPECT_EQ(store.size(), 3u);
+	EXPECT_EQ(store.peek(), "a");
+}
+
+TEST(MemoryOfflineStoreTest, LimitsBytes) {
+	MemoryOfflineStore store(0, 4, OverflowPolicy::DropOldest);
+	store.push("ab", 1);
+	store.push("cd", 1);
+	store.push("ef", 1);
+	EXPECT_EQ(store.bytes(), 4u);
+	EXPECT_EQ(store.peek(), "cd");
+
+	// An entry larger than the limit can never fit
+	store.push("ghijk", 1);
+	EXPECT_EQ(store.bytes(), 4u);
+	EXPECT_EQ(store.dropped(), 2u);
+}
+
+TEST(MemoryOfflineStoreTest, IgnoresAcksOfDroppedEntries) {
+	MemoryOfflineStore store(2, 0, OverflowPolicy::DropOldest);
+	store.push("a", 1);
+	store.push("b", 1);
+	uint64_t a = store.advance();
+
+	// Dropping "a" while in flight means its ack must not discard "b"
+	store.push("c", 1);
+	uint64_t b = store.advance();
+	store.ack(a);
+	EXPECT_EQ(store.size(), 2u);
+	EXPECT_EQ(store.peek(), "c");
+
+	store.ack(b);
+	EXPECT_EQ(store.size(), 1u);
+	EXPECT_EQ(store.peek(), "c");
+}
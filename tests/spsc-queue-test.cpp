@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include "spsc-queue.hpp"
+
+TEST(SpscQueueTest, PopsInOrder) {
+	SpscQueue<int> queue(4);
+	EXPECT_EQ(queue.pop(), std::nullopt);
+
+	for (int i = 0; i < 3; ++i) {
+		queue.emplace(i);
+	}
+	EXPECT_EQ(queue.size(), 3u);
+	for (int i = 0; i < 3; ++i) {
+		EXPECT_EQ(queue.pop(), i);
+	}
+	EXPECT_EQ(queue.pop(), std::nullopt);
+}
+
+TEST(SpscQueueTest, KeepsOrderWhenOverflowing) {
+	SpscQueue<int> queue(2);
+	for (int i = 0; i < 5; ++i) {
+		queue.emplace(i);
+	}
+	EXPECT_EQ(queue.size(), 5u);
+
+	// Messages pushed after the overflow started also go to the overflow,
+	// even once the ring has room again
+	EXPECT_EQ(queue.pop(), 0);
+	queue.emplace(5);
+	for (int i = 1; i < 6; ++i) {
+		EXPECT_EQ(queue.pop(), i);
+	}
+	EXPECT_EQ(queue.pop(), std::nullopt);
+
+	// The ring is used again once the overflow is empty
+	EXPECT_TRUE(queue.try_emplace(6));
+	EXPECT_EQ(queue.pop(), 6);
+}
+
+TEST(SpscQueueTest, TryEmplaceDoesNotOverflow) {
+	SpscQueue<int> queue(2);
+	EXPECT_TRUE(queue.try_emplace(0));
+	EXPECT_TRUE(queue.try_emplace(1));
+	EXPECT_FALSE(queue.try_emplace(2));
+	EXPECT_EQ(queue.size(), 2u);
+
+	// Not while messages are waiting in the overflow either
+	queue.emplace(2);
+	EXPECT_EQ(queue.pop(), 0);
+	EXPECT_FALSE(queue.try_emplace(3));
+}
+
+TEST(SpscQueueTest, DrainsRingAndOverflow) {
+	SpscQueue<int> queue(4);
+	for (int i = 0; i < 10; ++i) {
+		queue.emplace(i);
+	}
+	EXPECT_EQ(queue.pop(), 0);
+
+	// Drained messages are appended after those already in the vector
+	std::vector<int> out{-1};
+	EXPECT_EQ(queue.drain(out), 9u);
+	std::vector<int> expected{-1};
+	for (int i = 1; i < 10; ++i) {
+		expected.push_back(i);
+	}
+	EXPECT_EQ(out, expected);
+
+	EXPECT_EQ(queue.drain(out), 0u);
+	EXPECT_EQ(queue.size(), 0u);
+}
+
+TEST(SpscQueueTest, PassesMessagesBetweenThreads) {
+	const int count = 100000;
+	SpscQueue<int> queue(16);
+	std::thread producer([&queue]() {
+		for (int i = 0; i < count; ++i) {
+			queue.emplace(i);
+		}
+	});
+
+	// Alternate between pop() and drain() while the producer is running
+	std::vector<int> received;
+	std::vector<int> batch;
+	while (received.size() < static_cast<size_t>(count)) {
+		if (auto message = queue.pop()) {
+			received.push_back(*message);
+		}
+		queue.drain(batch);
+		received.insert(received.end(), batch.begin(), batch.end());
+		batch.clear();
+	}
+	producer.join();
+
+	for (int i = 0; i < count; ++i) {
+		ASSERT_EQ(received[i], i);
+	}
+	EXPECT_EQ(queue.pop(), std::nullopt);
+}
@@ -0,0 +1,145 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "telemetry-cache.hpp"
+
+// Compares the dense TelemetryCache against the previous layout of a
+// std::unordered_map of values plus a std::unordered_set of dirty keys.
+// Each round updates every key with a new value and then flushes the dirty
+// keys into a JSON object, as Controller::publishTelemetry() and send() do.
+
+using Clock = std::chrono::steady_clock;
+
+static const int ROUNDS = 20;
+
+struct LegacyStore {
+	std::unordered_map<std::string, nlohmann::json> data;
+	std::unordered_set<std::string> tainted;
+
+	void publish(const char* key, nlohmann::json&& value) {
+		auto it = data.find(key);
+		if (it == data.end()) {
+			data.emplace(key, std::move(value));
+			tainted.insert(key);
+		} else if (it->second != value) {
+			it->second = std::move(value);
+			tainted.insert(key);
+		}
+	}
+
+	size_t flush() {
+		nlohmann::json values;
+		for (const auto& key : tainted) {
+			values[key] = data[key];
+		}
+		tainted.clear();
+		return values.size();
+	}
+};
+
+struct CacheStore {
+	TelemetryCache cache;
+
+	void publish(TelemetryCache::Handle handle, nlohmann::json&& value) {
+		if (!cache.hasValue(handle) || cache.value(handle) != value) {
+			cache.markDirty(handle);
+			cache.set(handle, std::move(value), 0);
+		}
+	}
+
+	size_t flush() {
+		nlohmann::json values;
+		cache.forEachDirty([&](TelemetryCache::Handle handle) {
+			values[cache.key(handle)] = cache.value(handle);
+		});
+		cache.clearDirty();
+		return values.size();
+	}
+};
+
+static double elapsedNs(Clock::time_point start, size_t ops) {
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				  Clock::now() - start)
+				  .count();
+	return static_cast<double>(ns) / static_cast<double>(ops);
+}
+
+static void benchmark(size_t num_keys) {
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < num_keys; ++i) {
+		keys.push_back("telemetry_key_" + std::to_string(i));
+	}
+
+	size_t updates = num_keys * ROUNDS;
+	size_t flushed = 0;
+
+	// Previous layout, updating by name
+	LegacyStore legacy;
+	Clock::time_point start = Clock::now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t i = 0; i < num_keys; ++i) {
+			legacy.publish(keys[i].c_str(), round * 0.5 + i);
+		}
+	}
+	double legacy_update = elapsedNs(start, updates);
+	start = Clock::now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t i = 0; i < num_keys; ++i) {
+			legacy.publish(keys[i].c_str(), round * 0.25 + i);
+		}
+		flushed += legacy.flush();
+	}
+	double legacy_cycle = elapsedNs(start, updates);
+
+	// Dense cache, updating by name
+	CacheStore by_name;
+	start = Clock::now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t i = 0; i < num_keys; ++i) {
+			by_name.publish(by_name.cache.intern(keys[i].c_str()),
+							round * 0.5 + i);
+		}
+	}
+	double name_update = elapsedNs(start, updates);
+
+	// Dense cache, updating by handle
+	CacheStore by_handle;
+	std::vector<TelemetryCache::Handle> handles;
+	for (const auto& key : keys) {
+		handles.push_back(by_handle.cache.intern(key.c_str()));
+	}
+	start = Clock::now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t i = 0; i < num_keys; ++i) {
+			by_handle.publish(handles[i], round * 0.5 + i);
+		}
+	}
+	double handle_update = elapsedNs(start, updates);
+	start = Clock::now();
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (size_t i = 0; i < num_keys; ++i) {
+			by_handle.publish(handles[i], round * 0.25 + i);
+		}
+		flushed += by_handle.flush();
+	}
+	double handle_cycle = elapsedNs(start, updates);
+
+	printf("%8zu keys | update ns/op: legacy %7.1f, by name %7.1f, by handle "
+		   "%7.1f | update+flush ns/op: legacy %7.1f, by handle %7.1f\n",
+		   num_keys, legacy_update, name_update, handle_update, legacy_cycle,
+		   handle_cycle);
+
+	if (flushed != 2 * updates) {
+		fprintf(stderr, "Unexpected number of flushed values\n");
+	}
+}
+
+int main() {
+	for (size_t num_keys : {10, 1000, 100000}) {
+		benchmark(num_keys);
+	}
+	return 0;
+}
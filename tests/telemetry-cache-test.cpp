@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "telemetry-cache.hpp"
+
+TEST(TelemetryCacheTest, InternsKeys) {
+	TelemetryCache cache;
+	TelemetryCache::Handle a = cache.intern("a");
+	TelemetryCache::Handle b = cache.intern("quote\"d");
+
+	EXPECT_NE(a, b);
+	EXPECT_EQ(cache.intern("a"), a);
+	EXPECT_EQ(cache.size(), 2u);
+	EXPECT_TRUE(cache.contains(b));
+	EXPECT_FALSE(cache.contains(2));
+	EXPECT_EQ(cache.key(b), "quote\"d");
+	EXPECT_EQ(cache.quotedKey(b), "\"quote\\\"d\"");
+}
+
+TEST(TelemetryCacheTest, StoresValues) {
+	TelemetryCache cache;
+	TelemetryCache::Handle handle = cache.intern("a");
+	EXPECT_FALSE(cache.hasValue(handle));
+
+	cache.set(handle, "text", 5);
+	EXPECT_TRUE(cache.hasValue(handle));
+	EXPECT_EQ(cache.value(handle), "text");
+	EXPECT_EQ(cache.timestamp(handle), 5);
+
+	// Setting a value doesn't mark the key dirty
+	EXPECT_FALSE(cache.isDirty(handle));
+}
+
+TEST(TelemetryCacheTest, StoresNumbersByKind) {
+	TelemetryCache cache;
+	TelemetryCache::Handle handle = cache.intern("a");
+
+	cache.setNumber(handle, 3.0, 1);
+	EXPECT_TRUE(cache.value(handle).is_number_integer());
+	EXPECT_EQ(cache.value(handle), 3);
+
+	cache.setNumber(handle, 2.5, 2);
+	EXPECT_TRUE(cache.value(handle).is_number_float());
+	EXPECT_EQ(cache.value(handle), 2.5);
+	EXPECT_EQ(cache.timestamp(handle), 2);
+
+	cache.setBool(handle, true, 3);
+	EXPECT_EQ(cache.value(handle), true);
+
+	// Too large for an integer
+	EXPECT_TRUE(TelemetryCache::isIntegral(-9223372036854775808.0));
+	EXPECT_FALSE(TelemetryCache::isIntegral(9223372036854775808.0));
+	EXPECT_FALSE(TelemetryCache::isIntegral(0.5));
+}
+
+TEST(TelemetryCacheTest, ComparesScalars) {
+	TelemetryCache cache;
+	TelemetryCache::Handle handle = cache.intern("a");
+	EXPECT_FALSE(cache.equalsNumber(handle, 0.0));
+	EXPECT_FALSE(cache.equalsBool(handle, false));
+
+	cache.setNumber(handle, 4.0, 1);
+	EXPECT_TRUE(cache.equalsNumber(handle, 4.0));
+	EXPECT_FALSE(cache.equalsNumber(handle, 4.5));
+
+	cache.setNumber(handle, 4.5, 1);
+	EXPECT_TRUE(cache.equalsNumber(handle, 4.5));
+
+	// Values set as JSON can be unsigned
+	cache.set(handle, nlohmann::json(7u), 1);
+	ASSERT_TRUE(cache.value(handle).is_number_unsigned());
+	EXPECT_TRUE(cache.equalsNumber(handle, 7.0));
+	EXPECT_FALSE(cache.equalsNumber(handle, 8.0));
+
+	cache.setBool(handle, true, 1);
+	EXPECT_TRUE(cache.equalsBool(handle, true));
+	EXPECT_FALSE(cache.equalsBool(handle, false));
+	EXPECT_FALSE(cache.equalsNumber(handle, 1.0));
+
+	cache.set(handle, "1", 1);
+	EXPECT_FALSE(cache.equalsNumber(handle, 1.0));
+}
+
+TEST(TelemetryCacheTest, TracksDirtyKeys) {
+	TelemetryCache cache;
+	std::vector<TelemetryCache::Handle> handles;
+	for (int i = 0; i < 130; ++i) {
+		handles.push_back(cache.intern(("key" + std::to_string(i)).c_str()));
+	}
+
+	// Marking a key twice counts it once
+	for (size_t i : {129, 3, 64, 3}) {
+		cache.markDirty(handles[i]);
+	}
+	EXPECT_EQ(cache.dirtyCount(), 3u);
+	EXPECT_TRUE(cache.isDirty(handles[64]));
+	EXPECT_FALSE(cache.isDirty(handles[63]));
+
+	std::vector<TelemetryCache::Handle> dirty;
+	cache.forEachDirty(
+		[&dirty](TelemetryCache::Handle handle) { dirty.push_back(handle); });
+	EXPECT_EQ(dirty, (std::vector<TelemetryCache::Handle>{
+						 handles[3], handles[64], handles[129]}));
+
+	cache.clearDirty();
+	EXPECT_EQ(cache.dirtyCount(), 0u);
+	dirty.clear();
+	cache.forEachDirty(
+		[&dirty](TelemetryCache::Handle handle) { dirty.push_back(handle); });
+	EXPECT_TRUE(dirty.empty());
+}
@@ -0,0 +1,233 @@
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "telemetry-spool.hpp"
+
+namespace fs = std::filesystem;
+
+// Segments holding two 20 byte entries each
+static const size_t SEGMENT_SIZE = 80;
+
+class TelemetrySpoolTest : public ::testing::Test {
+   protected:
+	void SetUp() override {
+		const ::testing::TestInfo* info =
+			::testing::UnitTest::GetInstance()->current_test_info();
+		m_directory = (fs::temp_directory_path() /
+					   (std::string("thingsmqtt-spool-") + info->name()))
+						  .string();
+		fs::remove_all(m_directory);
+	}
+
+	void TearDown() override { fs::remove_all(m_directory); }
+
+	static std::string entry(int i) {
+		std::string payload = "{\"value\":" + std::to_string(i) + "}";
+		payload.resize(20, ' ');
+		return payload;
+	}
+
+	size_t segmentFiles() const {
+		size_t count = 0;
+		for (const auto& file : fs::directory_iterator(m_directory)) {
+			count += file.path().extension() == ".seg";
+		}
+		return count;
+	}
+
+	std::string m_directory;
+};
+
+TEST_F(TelemetrySpoolTest, RecoversEntriesOnReopen) {
+	{
+		TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+		for (int i = 0; i < 5; ++i) {
+			spool.push(entry(i), 1);
+		}
+
+		// Acked entries are not recovered
+		spool.ack(spool.advance());
+		EXPECT_EQ(segmentFiles(), 3u);
+	}
+
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	EXPECT_EQ(spool.size(), 4u);
+	EXPECT_EQ(spool.bytes(), 80u);
+	for (int i = 1; i < 5; ++i) {
+		ASSERT_TRUE(spool.hasPending());
+		EXPECT_EQ(spool.peek(), entry(i));
+		spool.advance();
+	}
+	EXPECT_FALSE(spool.hasPending());
+}
+
+TEST_F(TelemetrySpoolTest, RecoversQosOnReopen) {
+	{
+		TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+		spool.push(entry(0), 2);
+		spool.push(entry(1), 1);
+		spool.push(entry(2), 2);
+	}
+
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	for (int qos : {2, 1, 2}) {
+		ASSERT_TRUE(spool.hasPending());
+		EXPECT_EQ(spool.peekQos(), qos);
+		spool.advance();
+	}
+}
+
+TEST_F(TelemetrySpoolTest, TruncatesPartialEntries) {
+	{
+		TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+		spool.push(entry(0), 1);
+	}
+
+	// Fake a crash part way through writing an entry, whose length is
+	// written but not all of its payload
+	std::string path = m_directory + "/spool-0.seg";
+	{
+		std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+		uint32_t header[4];
+		file.read(reinterpret_cast<char*>(header), sizeof(header));
+		uint32_t length = 40;
+		file.seekp(header[1]);
+		file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		header[1] += sizeof(length) + 10;
+		file.seekp(0);
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	}
+
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	EXPECT_EQ(spool.size(), 1u);
+
+	// New entries are written after the last complete one
+	spool.push(entry(1), 1);
+	EXPECT_EQ(spool.peek(), entry(0));
+	spool.advance();
+	EXPECT_EQ(spool.peek(), entry(1));
+}
+
+TEST_F(TelemetrySpoolTest, AcksAcrossSegments) {
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	for (int i = 0; i < 5; ++i) {
+		spool.push(entry(i), 1);
+	}
+	EXPECT_EQ(segmentFiles(), 3u);
+
+	std::vector<uint64_t> ids;
+	for (int i = 0; i < 5; ++i) {
+		ASSERT_TRUE(spool.hasPending());
+		EXPECT_EQ(spool.peek(), entry(i));
+		ids.push_back(spool.advance());
+	}
+
+	// Fully acked segments are deleted, apart from the one being written
+	for (int i = 0; i < 4; ++i) {
+		spool.ack(ids[i]);
+	}
+	EXPECT_EQ(spool.size(), 1u);
+	EXPECT_EQ(segmentFiles(), 1u);
+
+	spool.ack(ids[4]);
+	EXPECT_TRUE(spool.empty());
+	EXPECT_EQ(spool.bytes(), 0u);
+	EXPECT_EQ(segmentFiles(), 1u);
+}
+
+TEST_F(TelemetrySpoolTest, RewindRepublishesUnacked) {
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	std::vector<uint64_t> ids;
+	for (int i = 0; i < 3; ++i) {
+		spool.push(entry(i), 1);
+		ids.push_back(spool.advance());
+	}
+	spool.ack(ids[1]);
+
+	spool.rewind();
+	ASSERT_TRUE(spool.hasPending());
+	EXPECT_EQ(spool.peek(), entry(0));
+	spool.advance();
+	EXPECT_EQ(spool.peek(), entry(2));
+}
+
+TEST_F(TelemetrySpoolTest, PublishesAheadOfTheBacklog) {
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	for (int i = 0; i < 3; ++i) {
+		spool.push(entry(i), 1);
+	}
+	std::optional<uint64_t> live = spool.push(entry(3), 1);
+	ASSERT_TRUE(live);
+
+	// The live entry is skipped when replaying, and acking it ahead of the
+	// older entries keeps its segment until they are acked too
+	spool.markPublished(*live);
+	spool.ack(*live);
+	EXPECT_EQ(spool.size(), 3u);
+	EXPECT_EQ(segmentFiles(), 2u);
+
+	std::vector<uint64_t> ids;
+	for (int i = 0; i < 3; ++i) {
+		ASSERT_TRUE(spool.hasPending());
+		EXPECT_EQ(spool.peek(), entry(i));
+		ids.push_back(spool.advance());
+	}
+	EXPECT_FALSE(spool.hasPending());
+
+	for (uint64_t id : ids) {
+		spool.ack(id);
+	}
+	EXPECT_TRUE(spool.empty());
+	EXPECT_EQ(segmentFiles(), 1u);
+}
+
+TEST_F(TelemetrySpoolTest, RecoversOutOfOrderAcksOnReopen) {
+	{
+		TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+		spool.push(entry(0), 1);
+		std::optional<uint64_t> live = spool.push(entry(1), 1);
+		ASSERT_TRUE(live);
+		spool.markPublished(*live);
+		spool.ack(*live);
+	}
+
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 8);
+	EXPECT_EQ(spool.size(), 1u);
+	EXPECT_EQ(spool.peek(), entry(0));
+	spool.advance();
+	EXPECT_FALSE(spool.hasPending());
+}
+
+TEST_F(TelemetrySpoolTest, DropsOldestSegmentWhenFull) {
+	TelemetrySpool spool(m_directory, SEGMENT_SIZE, 2);
+	for (int i = 0; i < 4; ++i) {
+		spool.push(entry(i), 1);
+	}
+
+	// Publish the entries of the oldest segment, then drop it by needing
+	// a third segment
+	uint64_t first = spool.advance();
+	uint64_t second = spool.advance();
+	spool.push(entry(4), 1);
+	EXPECT_EQ(spool.dropped(), 2u);
+	EXPECT_EQ(spool.size(), 3u);
+	EXPECT_EQ(segmentFiles(), 2u);
+
+	// The read cursor moves to the new oldest segment
+	ASSERT_TRUE(spool.hasPending());
+	EXPECT_EQ(spool.peek(), entry(2));
+	uint64_t third = spool.advance();
+
+	// The acks of the dropped entries are ignored
+	spool.ack(first);
+	spool.ack(second);
+	EXPECT_EQ(spool.size(), 3u);
+
+	spool.ack(third);
+	EXPECT_EQ(spool.size(), 2u);
+	EXPECT_EQ(spool.peek(), entry(3));
+}
@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "telemetry-writer.hpp"
+
+TEST(TelemetryWriterTest, WritesSingleEntry) {
+	TelemetryWriter writer;
+	writer.begin(false);
+	writer.add(1, "\"a\"", 1);
+	writer.add(1, "\"b\"", true);
+
+	size_t size = writer.finishedSize();
+	std::string_view payload = writer.finish();
+	EXPECT_EQ(payload, "{\"ts\":1,\"values\":{\"a\":1,\"b\":true}}");
+	EXPECT_EQ(payload.size(), size);
+}
+
+TEST(TelemetryWriterTest, WritesEntryPerTimestamp) {
+	TelemetryWriter writer;
+	writer.begin(true);
+	writer.add(1, "\"a\"", 1);
+	writer.add(2, "\"b\"", "x");
+	writer.add(2, "\"c\"", 2.5);
+
+	size_t size = writer.finishedSize();
+	std::string_view payload = writer.finish();
+	EXPECT_EQ(payload,
+			  "[{\"ts\":1,\"values\":{\"a\":1}},"
+			  "{\"ts\":2,\"values\":{\"b\":\"x\",\"c\":2.5}}]");
+	EXPECT_EQ(payload.size(), size);
+}
+
+TEST(TelemetryWriterTest, RollsBackToCheckpoint) {
+	TelemetryWriter writer;
+	writer.begin(true);
+	EXPECT_TRUE(writer.checkpoint().empty());
+
+	writer.add(1, "\"a\"", 1);
+	TelemetryWriter::Checkpoint checkpoint = writer.checkpoint();
+	EXPECT_FALSE(checkpoint.empty());
+
+	// Undo a value that started a new entry, then continue the old entry
+	writer.add(2, "\"b\"", 2);
+	writer.rollback(checkpoint);
+	writer.add(1, "\"c\"", 3);
+
+	EXPECT_EQ(writer.finish(), "[{\"ts\":1,\"values\":{\"a\":1,\"c\":3}}]");
+}
+
+TEST(TelemetryWriterTest, SplitsAtMaxSize) {
+	const size_t max_size = 100;
+	TelemetryWriter writer;
+	std::vector<std::string> payloads;
+
+	// Add values until one doesn't fit, then undo it and start a new payload
+	// with it, as the controller does
+	writer.begin(true);
+	for (int i = 0; i < 20; ++i) {
+		std::string key = "\"key" + std::to_string(i) + "\"";
+		TelemetryWriter::Checkpoint checkpoint = writer.checkpoint();
+		writer.add(i, key, i);
+		if (writer.finishedSize() > max_size && !checkpoint.empty()) {
+			writer.rollback(checkpoint);
+			payloads.emplace_back(writer.finish());
+			writer.begin(true);
+			writer.add(i, key, i);
+		}
+	}
+	payloads.emplace_back(writer.finish());
+
+	ASSERT_GT(payloads.size(), 1u);
+	size_t values = 0;
+	for (const std::string& payload : payloads) {
+		EXPECT_LE(payload.size(), max_size);
+		nlohmann::json entries = nlohmann::json::parse(payload);
+		ASSERT_TRUE(entries.is_array());
+		values += entries.size();
+	}
+	EXPECT_EQ(values, 20u);
+}
+
+TEST(TelemetryWriterTest, AppendsArrayElements) {
+	// Replayed payloads are merged into one array, whether they are single
+	// entries or arrays themselves
+	std::string buffer = "[";
+	TelemetryWriter::appendArrayElements(buffer,
+										 "{\"ts\":1,\"values\":{\"a\":1}}");
+	buffer.push_back(',');
+	TelemetryWriter::appendArrayElements(
+		buffer,
+		"[{\"ts\":2,\"values\":{\"a\":2}},{\"ts\":3,\"values\":{\"a\":3}}]");
+	buffer.push_back(']');
+
+	nlohmann::json entries = nlohmann::json::parse(buffer);
+	ASSERT_EQ(entries.size(), 3u);
+	for (int i = 0; i < 3; ++i) {
+		EXPECT_EQ(entries[i]["ts"], i + 1);
+		EXPECT_EQ(entries[i]["values"]["a"], i + 1);
+	}
+}
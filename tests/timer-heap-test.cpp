@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "timer-heap.hpp"
+
+TEST(TimerHeapTest, RunsTimersInOrder) {
+	TimerHeap timers;
+	std::vector<int> calls;
+	timers.add(20, 0, [&calls]() { calls.push_back(2); });
+	timers.add(10, 0, [&calls]() { calls.push_back(1); });
+
+	EXPECT_EQ(timers.nextDue(), 10);
+	timers.runDue(5);
+	EXPECT_TRUE(calls.empty());
+
+	timers.runDue(20);
+	EXPECT_EQ(calls, (std::vector<int>{1, 2}));
+	EXPECT_TRUE(timers.empty());
+	EXPECT_EQ(timers.nextDue(), std::nullopt);
+}
+
+TEST(TimerHeapTest, ReschedulesPeriodicTimers) {
+	TimerHeap timers;
+	int calls = 0;
+	timers.add(10, 10, [&calls]() { ++calls; });
+
+	timers.runDue(10);
+	EXPECT_EQ(calls, 1);
+	EXPECT_EQ(timers.nextDue(), 20);
+
+	// Missed calls are skipped rather than run back to back
+	timers.runDue(55);
+	EXPECT_EQ(calls, 2);
+	EXPECT_EQ(timers.nextDue(), 65);
+}
+
+TEST(TimerHeapTest, CancelsTimers) {
+	TimerHeap timers;
+	int calls = 0;
+	size_t id = timers.add(10, 10, [&calls]() { ++calls; });
+	timers.add(30, 0, []() {});
+
+	EXPECT_TRUE(timers.cancel(id));
+	EXPECT_FALSE(timers.cancel(id));
+	EXPECT_EQ(timers.nextDue(), 30);
+
+	timers.runDue(30);
+	EXPECT_EQ(calls, 0);
+	EXPECT_TRUE(timers.empty());
+}
+
+TEST(TimerHeapTest, CancelsFromCallbacks) {
+	TimerHeap timers;
+	int calls = 0;
+	size_t later = 0;
+	size_t self = 0;
+	self = timers.add(10, 10, [&]() {
+		++calls;
+		timers.cancel(self);
+		timers.cancel(later);
+	});
+	later = timers.add(10, 0, [&calls]() { calls += 100; });
+
+	timers.runDue(10);
+	EXPECT_EQ(calls, 1);
+	EXPECT_TRUE(timers.empty());
+}
+
+TEST(TimerHeapTest, RunsTimersAddedByCallbacksLater) {
+	TimerHeap timers;
+	int calls = 0;
+	timers.add(10, 0, [&]() {
+		timers.add(0, 0, [&calls]() { ++calls; });
+	});
+
+	timers.runDue(10);
+	EXPECT_EQ(calls, 0);
+	EXPECT_EQ(timers.nextDue(), 0);
+
+	timers.runDue(10);
+	EXPECT_EQ(calls, 1);
+}